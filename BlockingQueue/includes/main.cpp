@@ -1,12 +1,25 @@
 #include "solution.h"
+#include "mpmc_queue.h"
+#include "spsc_queue.h"
+#include "two_lock_queue.h"
+#include "spilling_queue.h"
 #include "test_utils.h"
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <cstring>
 #include <deque>
+#include <functional>
+#include <iomanip>
+#include <iterator>
+#include <memory>
 #include <string>
 #include <vector>
 #include <sstream>
 
+#include <unistd.h>
+
 namespace QueueTests {
 
 #if defined(dump_field)
@@ -73,6 +86,8 @@ namespace QueueTests {
     private:
         mutable std::atomic<int> inside_critical{0};
         std::deque<T> impl;
+        size_t pushed = 0;
+        size_t popped = 0;
 
     private:
         CheckMutable get() { return CheckMutable(this); }
@@ -102,21 +117,77 @@ namespace QueueTests {
 
         void pop_front() {
             get_no_empty().impl().pop_front();
+            ++popped;
         }
 
         void push_back(const T& t) {
             get().impl().push_back(t);
+            ++pushed;
         }
 
         void push_back(T&& t) {
             get().impl().push_back(std::move(t));
+            ++pushed;
         }
 
         ~TestingContainer() {
             test_assert(get().impl().empty(), "expected empty");
+            test_assert(pushed == popped, "items lost or duplicated");
+        }
+    };
+
+    // BlockingQueue that spins and yields before parking
+    template <typename T, typename Container>
+    struct SpinningBlockingQueue : public BlockingQueue<T, Container> {
+        explicit SpinningBlockingQueue(size_t capacity)
+            : BlockingQueue<T, Container>(capacity, spin_options())
+        {}
+
+        static WaitOptions spin_options() {
+            WaitOptions options;
+            options.min_spins = 16;
+            options.max_spins = 1024;
+            options.yields = 4;
+            return options;
+        }
+
+        static size_t total(const WaitStats& stats) {
+            return stats.spun + stats.yielded + stats.parked;
+        }
+
+        size_t waits() const {
+            return total(this->ReaderWaitStats()) + total(this->WriterWaitStats());
         }
     };
 
+    template <class Queue>
+    void check_queue_after_test(const Queue&, const TestQueueOpts&) {
+    }
+
+    template <typename T, typename Container>
+    void check_queue_after_test(const SpinningBlockingQueue<T, Container>& queue, const TestQueueOpts& opts) {
+        // a single Put or Get records at most one stage
+        size_t calls = 2 * opts.n_items + opts.n_readers + opts.n_writers;
+        test_assert(queue.waits() <= calls, "too many waits recorded");
+    }
+
+    template <typename T, typename Container>
+    void check_queue_after_test(const BlockingQueue<T, Container, QueueStats>& queue, const TestQueueOpts& opts) {
+        QueueStatsSnapshot stats = queue.Stats();
+        test_assert(stats.puts == opts.n_items && stats.gets == opts.n_items, "invalid put/get counts");
+
+        size_t samples = 0;
+        for (size_t bucket : stats.occupancy) {
+            samples += bucket;
+        }
+        test_assert(samples == 2 * opts.n_items, "every operation samples occupancy");
+
+        test_assert(stats.put_waits <= opts.n_items && stats.get_waits <= opts.n_items, "too many waits recorded");
+        test_assert(stats.max_put_wait <= stats.put_wait_time && stats.max_get_wait <= stats.get_wait_time,
+                    "max wait exceeds total wait");
+        test_assert(stats.shutdown_wakeups <= opts.n_readers + opts.n_writers, "too many shutdown wakeups");
+    }
+
     template <class Queue>
     struct testing_context {
         Queue queue;
@@ -143,30 +214,126 @@ namespace QueueTests {
         {}
     };
 
-    void do_test_queue(const TestQueueOpts& opts) {
-        std::cout << "Testing with parameters: " << opts.to_string() << std::endl;
+    struct Value : public std::pair<std::string, size_t> {
+        using Parent = std::pair<std::string, size_t>;
 
-        struct Value : public std::pair<std::string, size_t> {
-            using Parent = std::pair<std::string, size_t>;
+        Value() = default;
 
-            Value() = default;
+        Value(Value&&) = default;
+        Value& operator=(Value&&) = default;
 
-            Value(Value&&) = default;
-            Value& operator=(Value&&) = default;
+        Value(const Value&) = delete;
+        Value& operator=(const Value&) = delete;
 
-            Value(const Value&) = delete;
-            Value& operator=(const Value&) = delete;
+        Value(const std::string& s, size_t n)
+            : Parent(s, n)
+        {}
 
-            Value(const std::string& s, size_t n)
-                : Parent(s, n)
-            {}
+        Value(std::string&& s, size_t n)
+            : Parent(std::move(s), n)
+        {}
+    };
 
-            Value(std::string&& s, size_t n)
-                : Parent(std::move(s), n)
-            {}
-        };
+    struct ValueSerializer {
+        static void Serialize(const Value& item, std::string& out) {
+            out.append(reinterpret_cast<const char*>(&item.second), sizeof(item.second));
+            out.append(item.first);
+        }
+
+        static Value Deserialize(const char* data, size_t size) {
+            size_t n;
+            std::memcpy(&n, data, sizeof(n));
+            return Value(std::string(data + sizeof(n), size - sizeof(n)), n);
+        }
+    };
+
+    // Fresh spill directory that must be empty again when it is removed
+    struct TempDir {
+        std::string path;
+
+        TempDir() {
+            char pattern[] = "/tmp/spill_test_XXXXXX";
+            test_assert(mkdtemp(pattern) != nullptr, "could not create temp dir");
+            path = pattern;
+        }
+
+        ~TempDir() {
+            test_assert(rmdir(path.c_str()) == 0, "spill segments left behind");
+        }
+    };
+
+    // The directory is a base so that it outlives the queue's segments
+    struct SpillingTestQueue : private TempDir, public SpillingBlockingQueue<Value, ValueSerializer> {
+        static const size_t segment_size = 4096;
+
+        explicit SpillingTestQueue(size_t capacity)
+            : SpillingBlockingQueue<Value, ValueSerializer>(capacity, path, segment_size)
+        {}
+    };
+
+    const size_t SpillingTestQueue::segment_size;
+
+    void check_queue_after_test(const SpillingTestQueue& queue, const TestQueueOpts&) {
+        test_assert(queue.Spilled() == 0, "spilled items left on disk");
+    }
+
+    // Moves items through the queue one by one
+    struct ItemOps {
+        template <class Queue>
+        static void put(Queue& queue, std::vector<Value>& items) {
+            for (auto& item : items) {
+                queue.Put(std::move(item));
+            }
+        }
+
+        template <class Queue, class Consume>
+        static void get(Queue& queue, size_t count, Consume consume) {
+            for (size_t i = 0; i < count; ++i) {
+                Value s;
+                test_assert(queue.Get(s), "queue is shutdown");
+                consume(s);
+            }
+        }
+    };
+
+    // Moves items through the queue in PutMany/GetMany batches
+    struct BatchOps {
+        static const size_t batch_size = 16;
+
+        template <class Queue>
+        static void put(Queue& queue, std::vector<Value>& items) {
+            for (auto it = items.begin(); it != items.end();) {
+                auto last = it + std::min<size_t>(batch_size, items.end() - it);
+                while (it != last) {
+                    auto next = queue.PutMany(it, last);
+                    test_assert(next != it, "nothing was put");
+                    it = next;
+                }
+            }
+        }
+
+        template <class Queue, class Consume>
+        static void get(Queue& queue, size_t count, Consume consume) {
+            std::vector<Value> batch;
+            while (count > 0) {
+                batch.clear();
+                size_t got = queue.GetMany(std::back_inserter(batch), std::min(count, batch_size));
+                test_assert(got > 0, "queue is shutdown");
+                test_assert(got == batch.size(), "invalid batch size");
+                for (auto& s : batch) {
+                    consume(s);
+                }
+                count -= got;
+            }
+        }
+    };
+
+    const size_t BatchOps::batch_size;
+
+    template <class Queue, class Ops = ItemOps>
+    void do_test_queue(const TestQueueOpts& opts, const std::string& name) {
+        std::cout << "Testing " << name << " with parameters: " << opts.to_string() << std::endl;
 
-        using Queue = BlockingQueue<Value, TestingContainer<Value>>;
         testing_context<Queue> ctx{opts};
 
         std::vector<std::thread> writers{opts.n_writers};
@@ -178,14 +345,17 @@ namespace QueueTests {
                 try {
                     ctx.barrier_begin.wait();
 
+                    std::vector<Value> items;
                     for (size_t i = ctx.write_count * thr, cnt = i + ctx.write_count; i < cnt; ++i) {
-                      ctx.queue.Put(Value(std::to_string(i), i));
+                        items.emplace_back(std::to_string(i), i);
                     }
 
                     if (thr < ctx.write_mod) {
-                        ctx.queue.Put(Value(std::to_string(thr), thr));
+                        items.emplace_back(std::to_string(thr), thr);
                     }
 
+                    Ops::put(ctx.queue, items);
+
                     ctx.barrier_shutdown_enter.wait();
 
                     ctx.barrier_shutdown_exit.wait();
@@ -213,17 +383,15 @@ namespace QueueTests {
                 try {
                     ctx.barrier_begin.wait();
 
-                    for (size_t i = ctx.read_count * thr, cnt = i + ctx.read_count; i < cnt; ++i) {
-                        Value s; 
-                        test_assert(ctx.queue.Get(s), "queue is shutdown");
-                        test_assert(s.first == std::to_string(s.second), "invalid value found in queue");
-                    }
-
-                    if (thr < ctx.read_mod) {
-                        Value s;
-                        test_assert(ctx.queue.Get(s), "queue is shutdown");
+                    bool first = true;
+                    size_t last = 0;
+                    Ops::get(ctx.queue, ctx.read_count + (thr < ctx.read_mod ? 1 : 0), [&](const Value& s) {
                         test_assert(s.first == std::to_string(s.second), "invalid value found in queue");
-                    }
+                        // a single writer puts increasing values, so every reader must see them in order
+                        test_assert(opts.n_writers > 1 || first || last < s.second, "FIFO order violated");
+                        first = false;
+                        last = s.second;
+                    });
 
                     ctx.barrier_shutdown_enter.wait();
 
@@ -269,17 +437,287 @@ namespace QueueTests {
         }
         std::cout << "Done" << std::endl;
 
+        check_queue_after_test(ctx.queue, opts);
+
+        std::cout << "OK" << std::endl;
+    }
+
+    void do_test_ring_buffer() {
+        std::cout << "Testing RingBuffer wrap-around and bulk copies ... " << std::endl;
+
+        const size_t capacity = 7;
+        RingBuffer<size_t> ring{capacity};
+        std::vector<size_t> items(3 * capacity);
+        for (size_t i = 0; i < items.size(); ++i) {
+            items[i] = i;
+        }
+
+        size_t next_in = 0;
+        size_t next_out = 0;
+        for (size_t round = 0; round < 2 * capacity; ++round) {
+            auto first = items.begin() + next_in % items.size();
+            auto last = std::min(first + 5, items.end());
+            next_in += ring.append(first, last, capacity - ring.size()) - first;
+            test_assert(ring.size() <= capacity && ring.capacity() == capacity, "ring grew");
+
+            size_t out[4];
+            size_t got = ring.pop_front_n(out, 1 + round % 4) - out;
+            for (size_t i = 0; i < got; ++i, ++next_out) {
+                test_assert(out[i] == next_out % items.size(), "invalid value found in ring");
+            }
+        }
+        test_assert(next_in - next_out == ring.size(), "items lost");
+
+        BlockingQueue<Value> queue{2};
+        queue.Emplace("1", 1);
+        Value s;
+        test_assert(queue.Get(s) && s.first == "1" && s.second == 1, "invalid emplaced value");
+
+        std::cout << "Done" << std::endl;
+    }
+
+    // With a single slot in memory and nobody reading, nearly every item
+    // goes to disk, over several segments, and comes back in order
+    void do_test_spilling() {
+        std::cout << "Testing SpillingBlockingQueue segments ... " << std::endl;
+
+        SpillingTestQueue queue{1};
+        // every record takes at least 8 bytes
+        const size_t n_items = 2 * SpillingTestQueue::segment_size / 8;
+        for (size_t i = 0; i < n_items; ++i) {
+            queue.Put(Value(std::to_string(i), i));
+        }
+        test_assert(queue.TotalSpilled() == n_items - 1 && queue.Spilled() == n_items - 1, "items not spilled");
+        test_assert(queue.Segments() >= 2, "spill did not roll over to a new segment");
+
+        for (size_t i = 0; i < n_items; ++i) {
+            Value s;
+            test_assert(queue.Get(s), "queue is shutdown");
+            test_assert(s.second == i && s.first == std::to_string(i), "spilled items out of order");
+        }
+        test_assert(queue.Spilled() == 0 && queue.Segments() <= 1, "read segments not removed");
+
+        std::cout << "Done" << std::endl;
+    }
+
+    // One thread at a time waits, with the other side acting long after
+    // spinning and yielding are over, so every wait lands in a known stage
+    void do_test_wait_stages() {
+        std::cout << "Testing spin-then-park wait stages ... " << std::endl;
+
+        using Queue = SpinningBlockingQueue<Value, TestingContainer<Value>>;
+        Queue queue{1};
+        auto later = [](std::function<void()> fn) {
+            return std::thread([fn]() {
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                fn();
+            });
+        };
+        auto same = [](const WaitStats& stats, size_t spun, size_t yielded, size_t parked) {
+            return stats.spun == spun && stats.yielded == yielded && stats.parked == parked;
+        };
+
+        // no wait at all
+        queue.Put(Value("0", 0));
+        Value s;
+        test_assert(queue.Get(s), "queue is shutdown");
+        test_assert(queue.waits() == 0, "wait recorded without waiting");
+
+        // an empty queue parks the reader
+        std::thread writer = later([&queue]() {
+            queue.Put(Value("1", 1));
+        });
+        test_assert(queue.Get(s) && s.second == 1, "invalid value found in queue");
+        writer.join();
+        test_assert(same(queue.ReaderWaitStats(), 0, 0, 1), "reader did not park");
+
+        // a full queue parks the writer
+        queue.Put(Value("2", 2));
+        std::thread reader = later([&queue]() {
+            Value s;
+            test_assert(queue.Get(s) && s.second == 2, "invalid value found in queue");
+        });
+        queue.Put(Value("3", 3));
+        reader.join();
+        test_assert(same(queue.WriterWaitStats(), 0, 0, 1), "writer did not park");
+        test_assert(queue.Get(s) && s.second == 3, "invalid value found in queue");
+
+        // a shutdown queue turns callers away without a wait
+        queue.Shutdown();
+        test_assert(!queue.Get(s), "queue isn't shutdown");
+        test_assert(same(queue.ReaderWaitStats(), 0, 0, 1) && same(queue.WriterWaitStats(), 0, 0, 1),
+                    "wait recorded after shutdown");
+
+        std::cout << "Done" << std::endl;
+    }
+
+    // Writers spread their items over several queues with SelectPut and
+    // readers drain all of them with SelectGet
+    void do_test_select(const TestQueueOpts& opts) {
+        const size_t n_queues = 4;
+        std::cout << "Testing Select over " << n_queues << " queues with parameters: " << opts.to_string() << std::endl;
+
+        using Queue = BlockingQueue<Value>;
+        std::vector<std::unique_ptr<Queue>> storage;
+        std::vector<Queue*> queues;
+        for (size_t i = 0; i < n_queues; ++i) {
+            storage.emplace_back(new Queue{TestQueueOpts::queue_capacity});
+            queues.push_back(storage.back().get());
+        }
+
+        // unwatching a selector that never watched is harmless
+        Selector stranger;
+        queues.front()->Watch(&stranger, QueueEvent::kReadable);
+        queues.front()->Unwatch(&stranger, QueueEvent::kWritable);
+        queues.front()->Unwatch(&stranger, QueueEvent::kReadable);
+        queues.front()->Unwatch(&stranger, QueueEvent::kReadable);
+
+        Barrier barrier_begin{opts.n_readers + opts.n_writers + 1};
+        Barrier barrier_shutdown_enter{opts.n_readers + opts.n_writers + 1};
+        Barrier barrier_shutdown_exit{opts.n_readers + opts.n_writers + 1};
+        std::vector<std::thread> threads;
+
+        std::cout << "Preparing writers ... " << std::endl;
+        for (size_t thr = 0; thr < opts.n_writers; ++thr) {
+            threads.emplace_back([thr, &queues, &barrier_begin, &barrier_shutdown_enter, &barrier_shutdown_exit, &opts]() {
+                barrier_begin.wait();
+                size_t count = opts.n_items / opts.n_writers + (thr < opts.n_items % opts.n_writers ? 1 : 0);
+                for (size_t i = 0; i < count; ++i) {
+                    test_assert(SelectPut(queues, Value(std::to_string(i), i)) < queues.size(), "queues are shutdown");
+                }
+                barrier_shutdown_enter.wait();
+                barrier_shutdown_exit.wait();
+            });
+        }
+
+        std::cout << "Preparing readers ... " << std::endl;
+        for (size_t thr = 0; thr < opts.n_readers; ++thr) {
+            threads.emplace_back([thr, &queues, &barrier_begin, &barrier_shutdown_enter, &barrier_shutdown_exit, &opts]() {
+                barrier_begin.wait();
+                size_t count = opts.n_items / opts.n_readers + (thr < opts.n_items % opts.n_readers ? 1 : 0);
+                for (size_t i = 0; i < count; ++i) {
+                    Value s;
+                    test_assert(SelectGet(queues, s) < queues.size(), "queues are shutdown");
+                    test_assert(s.first == std::to_string(s.second), "invalid value found in queue");
+                }
+                barrier_shutdown_enter.wait();
+                barrier_shutdown_exit.wait();
+
+                Value s;
+                test_assert(SelectGet(queues, s) == kNoQueue, "queues aren't shutdown");
+                test_assert(WaitAny(queues, QueueEvent::kReadable) < queues.size(), "shutdown queue isn't ready");
+            });
+        }
+
+        std::cout << "Starting test ... " << std::endl;
+        barrier_begin.wait();
+        std::cout << "Done" << std::endl;
+
+        std::cout << "Shutting queues ... " << std::endl;
+        barrier_shutdown_enter.wait();
+        test_assert(WaitAny(queues, QueueEvent::kWritable) < queues.size(), "drained queues have no room");
+        for (auto queue : queues) {
+            queue->Shutdown();
+        }
+        barrier_shutdown_exit.wait();
+        std::cout << "Done" << std::endl;
+
+        std::cout << "Joining threads ... " << std::endl;
+        for (auto& thr : threads) {
+            thr.join();
+        }
+        std::cout << "Done" << std::endl;
+
         std::cout << "OK" << std::endl;
     }
 
     void run_queue_tests(int argc, char* argv[]) {
         TestQueueOpts opts;
         read_opts(argc, argv, TestQueueOpts::queue_capacity, opts.n_readers, opts.n_writers, opts.n_items);
-        do_test_queue(opts);
+        do_test_ring_buffer();
+        do_test_wait_stages();
+        do_test_spilling();
+        do_test_queue<BlockingQueue<Value, TestingContainer<Value>>>(opts, "BlockingQueue");
+        do_test_queue<BlockingQueue<Value, TestingContainer<Value>>, BatchOps>(opts, "BlockingQueue PutMany/GetMany");
+        do_test_queue<BlockingQueue<Value>, BatchOps>(opts, "BlockingQueue over RingBuffer");
+        do_test_queue<SpinningBlockingQueue<Value, TestingContainer<Value>>>(opts, "BlockingQueue spin-then-park");
+        do_test_queue<BlockingQueue<Value, TestingContainer<Value>, QueueStats>>(opts, "BlockingQueue with stats");
+        do_test_queue<MPMCBlockingQueue<Value>>(opts, "MPMCBlockingQueue");
+        if (opts.n_readers == 1 && opts.n_writers == 1) {
+            do_test_queue<SPSCBlockingQueue<Value>>(opts, "SPSCBlockingQueue");
+        }
+        do_test_queue<TwoLockBlockingQueue<Value>>(opts, "TwoLockBlockingQueue");
+        do_test_queue<SpillingTestQueue>(opts, "SpillingBlockingQueue");
+        do_test_select(opts);
+    }
+
+    ///////////////////////////////////////////////////////////
+    // Benchmarks over the generate_tests capacity/readers/writers grid
+    ///////////////////////////////////////////////////////////
+
+    template <class Queue>
+    double bench_queue(size_t capacity, size_t n_readers, size_t n_writers, size_t n_items) {
+        Queue queue{capacity};
+        Barrier barrier_begin{n_readers + n_writers + 1};
+        std::vector<std::thread> threads;
+
+        for (size_t thr = 0; thr < n_writers; ++thr) {
+            threads.emplace_back([&, thr]() {
+                size_t count = n_items / n_writers + (thr < n_items % n_writers ? 1 : 0);
+                barrier_begin.wait();
+                for (size_t i = 0; i < count; ++i) {
+                    queue.Put(Value(std::to_string(i), i));
+                }
+            });
+        }
+
+        for (size_t thr = 0; thr < n_readers; ++thr) {
+            threads.emplace_back([&, thr]() {
+                size_t count = n_items / n_readers + (thr < n_items % n_readers ? 1 : 0);
+                barrier_begin.wait();
+                for (size_t i = 0; i < count; ++i) {
+                    Value s;
+                    test_assert(queue.Get(s), "queue is shutdown");
+                }
+            });
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        barrier_begin.wait();
+        for (auto& thr : threads) {
+            thr.join();
+        }
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        return elapsed.count();
+    }
+
+    void run_queue_benchmarks(int argc, char* argv[]) {
+        size_t n_items = argc > 2 ? std::stoul(argv[2]) : 100000;
+
+        std::cout << "Benchmarking with n_items=" << n_items << ", times in ms" << std::endl;
+        std::cout << std::setw(10) << "capacity" << std::setw(9) << "readers" << std::setw(9) << "writers"
+                  << std::setw(16) << "BlockingQueue" << std::setw(16) << "TwoLock" << std::setw(16) << "MPMC"
+                  << std::endl;
+        for (size_t capacity = 1; capacity <= 10000; capacity *= 10) {
+            for (size_t n_readers = 1; n_readers < 4; ++n_readers) {
+                for (size_t n_writers = 1; n_writers < 4; ++n_writers) {
+                    std::cout << std::fixed << std::setprecision(1)
+                              << std::setw(10) << capacity << std::setw(9) << n_readers << std::setw(9) << n_writers
+                              << std::setw(16) << bench_queue<BlockingQueue<Value>>(capacity, n_readers, n_writers, n_items)
+                              << std::setw(16) << bench_queue<TwoLockBlockingQueue<Value>>(capacity, n_readers, n_writers, n_items)
+                              << std::setw(16) << bench_queue<MPMCBlockingQueue<Value>>(capacity, n_readers, n_writers, n_items)
+                              << std::endl;
+                }
+            }
+        }
     }
 }
 
 int main(int argc, char* argv[]) {
 //    QueueTests::simulate_ya_contest();
-    QueueTests::run_queue_tests(argc, argv);
+    if (argc >= 2 && argv[1] == std::string("--bench")) {
+        QueueTests::run_queue_benchmarks(argc, argv);
+    } else {
+        QueueTests::run_queue_tests(argc, argv);
+    }
 }
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+
+constexpr size_t kCacheLineSize = 64;
+
+///////////////////////////////////////////////////////////////////////
+
+// Parks threads until a lock-free state they are interested in may have
+// changed. Notifiers pay only an atomic load while nobody is parked, which
+// is enough as long as the state is published and checked by the predicate
+// with seq_cst operations.
+class EventCount {
+public:
+  EventCount()
+      : waiters_{0} {
+  }
+
+  EventCount(const EventCount&) = delete;
+  EventCount& operator=(const EventCount&) = delete;
+
+  template <class Predicate>
+  void Wait(Predicate ready) {
+    std::unique_lock<std::mutex> lock(mtx_);
+    waiters_.fetch_add(1, std::memory_order_seq_cst);
+    cond_.wait(lock, ready);
+    waiters_.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  void NotifyOne() {
+    if (HasWaiters()) {
+      { std::lock_guard<std::mutex> lock(mtx_); }
+      cond_.notify_one();
+    }
+  }
+
+  void NotifyAll() {
+    if (HasWaiters()) {
+      { std::lock_guard<std::mutex> lock(mtx_); }
+      cond_.notify_all();
+    }
+  }
+
+private:
+  std::atomic<size_t> waiters_;
+  std::mutex mtx_;
+  std::condition_variable cond_;
+
+  bool HasWaiters() {
+    return waiters_.load(std::memory_order_seq_cst) != 0;
+  }
+};
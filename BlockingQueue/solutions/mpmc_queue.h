@@ -0,0 +1,153 @@
+#pragma once
+
+#include "event_count.h"
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+// Bounded lock-free MPMC ring (D. Vyukov). Every cell carries a sequence
+// number telling whether it is ready to be written (2 * turn) or read
+// (2 * turn + 1) on the current lap over the ring, so an uncontended Put or
+// Get is a single CAS on tail_ or head_. Threads park only when the ring is
+// full or empty.
+template <class T>
+class MPMCBlockingQueue {
+public:
+  explicit MPMCBlockingQueue(const size_t capacity)
+      : capacity_{capacity}
+      , cells_{new Cell[capacity]}
+      , closed_{false}
+      , head_{0}
+      , tail_{0} {
+    if (capacity_ == 0) {
+      throw std::invalid_argument("capacity must be positive");
+    }
+    for (size_t i = 0; i < capacity_; ++i) {
+      cells_[i].sequence.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  MPMCBlockingQueue(const MPMCBlockingQueue&) = delete;
+  MPMCBlockingQueue& operator=(const MPMCBlockingQueue&) = delete;
+
+  ~MPMCBlockingQueue() {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    for (size_t pos = head_.load(std::memory_order_relaxed); pos != tail; ++pos) {
+      cells_[pos % capacity_].Item()->~T();
+    }
+  }
+
+  void Put(T&& item) {
+    for (;;) {
+      if (closed_.load(std::memory_order_acquire)) {
+        throw std::exception();
+      }
+      if (TryPut(std::move(item))) {
+        return;
+      }
+      not_full_.Wait([&] {
+        return closed_.load(std::memory_order_seq_cst) || !Full();
+      });
+    }
+  }
+
+  bool Get(T& result) {
+    for (;;) {
+      if (closed_.load(std::memory_order_acquire)) {
+        return false;
+      }
+      if (TryGet(result)) {
+        return true;
+      }
+      not_empty_.Wait([&] {
+        return closed_.load(std::memory_order_seq_cst) || !Empty();
+      });
+    }
+  }
+
+  void Shutdown() {
+    closed_.store(true, std::memory_order_seq_cst);
+    not_empty_.NotifyAll();
+    not_full_.NotifyAll();
+  }
+
+  bool TryPut(T&& item) {
+    size_t pos = tail_.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell& cell = cells_[pos % capacity_];
+      size_t turn = pos / capacity_;
+      if (cell.sequence.load(std::memory_order_acquire) == 2 * turn) {
+        if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          new (cell.Item()) T(std::move(item));
+          cell.sequence.store(2 * turn + 1, std::memory_order_seq_cst);
+          not_empty_.NotifyOne();
+          return true;
+        }
+      } else {
+        size_t prev = pos;
+        pos = tail_.load(std::memory_order_relaxed);
+        if (pos == prev) {
+          return false;
+        }
+      }
+    }
+  }
+
+  bool TryGet(T& result) {
+    size_t pos = head_.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell& cell = cells_[pos % capacity_];
+      size_t turn = pos / capacity_;
+      if (cell.sequence.load(std::memory_order_acquire) == 2 * turn + 1) {
+        if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          result = std::move(*cell.Item());
+          cell.Item()->~T();
+          cell.sequence.store(2 * turn + 2, std::memory_order_seq_cst);
+          not_full_.NotifyOne();
+          return true;
+        }
+      } else {
+        size_t prev = pos;
+        pos = head_.load(std::memory_order_relaxed);
+        if (pos == prev) {
+          return false;
+        }
+      }
+    }
+  }
+
+private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+
+    T* Item() {
+      return reinterpret_cast<T*>(&storage);
+    }
+  };
+
+  bool Full() const {
+    size_t pos = tail_.load(std::memory_order_relaxed);
+    size_t seq = cells_[pos % capacity_].sequence.load(std::memory_order_seq_cst);
+    return seq != 2 * (pos / capacity_);
+  }
+
+  bool Empty() const {
+    size_t pos = head_.load(std::memory_order_relaxed);
+    size_t seq = cells_[pos % capacity_].sequence.load(std::memory_order_seq_cst);
+    return seq != 2 * (pos / capacity_) + 1;
+  }
+
+  const size_t capacity_;
+  std::unique_ptr<Cell[]> cells_;
+  std::atomic<bool> closed_;
+  EventCount not_empty_;
+  EventCount not_full_;
+  alignas(kCacheLineSize) std::atomic<size_t> head_;
+  alignas(kCacheLineSize) std::atomic<size_t> tail_;
+};
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+
+enum class QueueSide {
+  kPut,
+  kGet,
+};
+
+// Occupancy is bucketed by powers of two: 0, 1, 2-3, 4-7, ...; the last
+// bucket takes everything above.
+constexpr size_t kOccupancyBuckets = 16;
+
+struct QueueStatsSnapshot {
+  size_t puts = 0;
+  size_t gets = 0;
+  size_t put_waits = 0;
+  size_t get_waits = 0;
+  std::chrono::nanoseconds put_wait_time{0};
+  std::chrono::nanoseconds get_wait_time{0};
+  std::chrono::nanoseconds max_put_wait{0};
+  std::chrono::nanoseconds max_get_wait{0};
+  size_t shutdown_wakeups = 0;
+  std::array<size_t, kOccupancyBuckets> occupancy{};
+
+  // Producers blocked on a full queue longer than consumers on an empty one
+  bool ConsumerBound() const {
+    return put_wait_time > get_wait_time;
+  }
+};
+
+///////////////////////////////////////////////////////////////////////
+
+// Default BlockingQueue stats policy: compiles down to nothing
+struct NoQueueStats {
+  static constexpr bool kEnabled = false;
+
+  void OnPut(size_t, size_t) {
+  }
+
+  void OnGet(size_t, size_t) {
+  }
+
+  void OnWait(QueueSide, std::chrono::nanoseconds, bool) {
+  }
+
+  QueueStatsSnapshot Snapshot() const {
+    return QueueStatsSnapshot();
+  }
+};
+
+// Counters sharded per thread so that concurrent operations do not bounce a
+// shared cache line; Snapshot aggregates the shards.
+class QueueStats {
+public:
+  static constexpr bool kEnabled = true;
+
+  QueueStats()
+      : shards_{new Shard[kShards]} {
+  }
+
+  void OnPut(const size_t count, const size_t occupancy) {
+    Shard& shard = LocalShard();
+    Add(shard.puts, count);
+    Add(shard.occupancy[Bucket(occupancy)], 1);
+  }
+
+  void OnGet(const size_t count, const size_t occupancy) {
+    Shard& shard = LocalShard();
+    Add(shard.gets, count);
+    Add(shard.occupancy[Bucket(occupancy)], 1);
+  }
+
+  void OnWait(const QueueSide side, const std::chrono::nanoseconds waited, const bool shutdown) {
+    Shard& shard = LocalShard();
+    size_t nanos = waited.count();
+    if (side == QueueSide::kPut) {
+      Add(shard.put_waits, 1);
+      Add(shard.put_wait_nanos, nanos);
+      Max(shard.max_put_wait_nanos, nanos);
+    } else {
+      Add(shard.get_waits, 1);
+      Add(shard.get_wait_nanos, nanos);
+      Max(shard.max_get_wait_nanos, nanos);
+    }
+    if (shutdown) {
+      Add(shard.shutdown_wakeups, 1);
+    }
+  }
+
+  QueueStatsSnapshot Snapshot() const {
+    QueueStatsSnapshot snapshot;
+    for (size_t i = 0; i < kShards; ++i) {
+      const Shard& shard = shards_[i];
+      snapshot.puts += Load(shard.puts);
+      snapshot.gets += Load(shard.gets);
+      snapshot.put_waits += Load(shard.put_waits);
+      snapshot.get_waits += Load(shard.get_waits);
+      snapshot.put_wait_time += std::chrono::nanoseconds(Load(shard.put_wait_nanos));
+      snapshot.get_wait_time += std::chrono::nanoseconds(Load(shard.get_wait_nanos));
+      snapshot.max_put_wait = std::max(snapshot.max_put_wait, std::chrono::nanoseconds(Load(shard.max_put_wait_nanos)));
+      snapshot.max_get_wait = std::max(snapshot.max_get_wait, std::chrono::nanoseconds(Load(shard.max_get_wait_nanos)));
+      snapshot.shutdown_wakeups += Load(shard.shutdown_wakeups);
+      for (size_t bucket = 0; bucket < kOccupancyBuckets; ++bucket) {
+        snapshot.occupancy[bucket] += Load(shard.occupancy[bucket]);
+      }
+    }
+    return snapshot;
+  }
+
+private:
+  static constexpr size_t kShards = 16;
+
+  struct Shard {
+    std::atomic<size_t> puts{0};
+    std::atomic<size_t> gets{0};
+    std::atomic<size_t> put_waits{0};
+    std::atomic<size_t> get_waits{0};
+    std::atomic<size_t> put_wait_nanos{0};
+    std::atomic<size_t> get_wait_nanos{0};
+    std::atomic<size_t> max_put_wait_nanos{0};
+    std::atomic<size_t> max_get_wait_nanos{0};
+    std::atomic<size_t> shutdown_wakeups{0};
+    std::array<std::atomic<size_t>, kOccupancyBuckets> occupancy{};
+    // keeps neighbouring shards off each other's cache lines
+    char padding[64];
+  };
+
+  std::unique_ptr<Shard[]> shards_;
+
+  Shard& LocalShard() {
+    static std::atomic<size_t> next_shard{0};
+    static thread_local size_t shard = next_shard.fetch_add(1, std::memory_order_relaxed) % kShards;
+    return shards_[shard];
+  }
+
+  static size_t Bucket(size_t occupancy) {
+    size_t bucket = 0;
+    for (; occupancy > 0 && bucket + 1 < kOccupancyBuckets; occupancy >>= 1) {
+      ++bucket;
+    }
+    return bucket;
+  }
+
+  static void Add(std::atomic<size_t>& counter, const size_t value) {
+    counter.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  static void Max(std::atomic<size_t>& counter, const size_t value) {
+    size_t current = counter.load(std::memory_order_relaxed);
+    while (current < value && !counter.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+    }
+  }
+
+  static size_t Load(const std::atomic<size_t>& counter) {
+    return counter.load(std::memory_order_relaxed);
+  }
+};
@@ -0,0 +1,190 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+template <class Iterator, class T>
+struct IsContiguousIterator
+    : std::integral_constant<bool,
+          std::is_same<Iterator, T*>::value ||
+          std::is_same<Iterator, const T*>::value ||
+          std::is_same<Iterator, typename std::vector<T>::iterator>::value ||
+          std::is_same<Iterator, typename std::vector<T>::const_iterator>::value> {
+};
+
+///////////////////////////////////////////////////////////////////////
+
+// Contiguous FIFO ring used as the default BlockingQueue storage. The queue
+// reserves its capacity once, after which pushes and pops never touch the
+// allocator. Bulk append/pop_front_n copy trivially copyable items between
+// contiguous ranges with memcpy, at most two segments per call.
+template <class T>
+class RingBuffer {
+public:
+  RingBuffer()
+      : data_{nullptr}
+      , capacity_{0}
+      , head_{0}
+      , size_{0} {
+  }
+
+  explicit RingBuffer(const size_t capacity)
+      : RingBuffer() {
+    reserve(capacity);
+  }
+
+  RingBuffer(const RingBuffer&) = delete;
+  RingBuffer& operator=(const RingBuffer&) = delete;
+
+  ~RingBuffer() {
+    clear();
+    ::operator delete(data_);
+  }
+
+  bool empty() const {
+    return size_ == 0;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  size_t capacity() const {
+    return capacity_;
+  }
+
+  T& front() {
+    return data_[head_];
+  }
+
+  const T& front() const {
+    return data_[head_];
+  }
+
+  void push_back(const T& item) {
+    emplace_back(item);
+  }
+
+  void push_back(T&& item) {
+    emplace_back(std::move(item));
+  }
+
+  template <class... Args>
+  void emplace_back(Args&&... args) {
+    if (size_ == capacity_) {
+      reserve(std::max<size_t>(2 * capacity_, 1));
+    }
+    new (data_ + Index(size_)) T(std::forward<Args>(args)...);
+    ++size_;
+  }
+
+  void pop_front() {
+    data_[head_].~T();
+    head_ = Index(1);
+    --size_;
+  }
+
+  void clear() {
+    while (!empty()) {
+      pop_front();
+    }
+  }
+
+  // Reallocates only when growing, which a bounded queue does exactly once
+  void reserve(const size_t capacity) {
+    if (capacity <= capacity_) {
+      return;
+    }
+    T* data = static_cast<T*>(::operator new(capacity * sizeof(T)));
+    for (size_t i = 0; i < size_; ++i) {
+      T& item = data_[Index(i)];
+      new (data + i) T(std::move(item));
+      item.~T();
+    }
+    ::operator delete(data_);
+    data_ = data;
+    capacity_ = capacity;
+    head_ = 0;
+  }
+
+  // Moves up to max_count items from [first, last) without growing.
+  // Returns the first item left behind.
+  template <class Iterator>
+  Iterator append(Iterator first, Iterator last, const size_t max_count) {
+    return Append(first, last, max_count, UseMemcpy<Iterator>());
+  }
+
+  // Moves up to max_count items out to out. Returns the advanced out.
+  template <class OutputIterator>
+  OutputIterator pop_front_n(OutputIterator out, const size_t max_count) {
+    return PopFrontN(out, std::min(max_count, size_), UseMemcpy<OutputIterator>());
+  }
+
+private:
+  T* data_;
+  size_t capacity_;
+  size_t head_;
+  size_t size_;
+
+  template <class Iterator>
+  using UseMemcpy = std::integral_constant<bool,
+      std::is_trivially_copyable<T>::value && IsContiguousIterator<Iterator, T>::value>;
+
+  size_t Index(const size_t offset) const {
+    size_t index = head_ + offset;
+    return index < capacity_ ? index : index - capacity_;
+  }
+
+  template <class Iterator>
+  Iterator Append(Iterator first, Iterator last, size_t max_count, std::false_type) {
+    max_count = std::min(max_count, capacity_ - size_);
+    for (; first != last && max_count > 0; ++first, --max_count) {
+      new (data_ + Index(size_)) T(std::move(*first));
+      ++size_;
+    }
+    return first;
+  }
+
+  template <class Iterator>
+  Iterator Append(Iterator first, Iterator last, size_t max_count, std::true_type) {
+    size_t count = std::min({max_count, capacity_ - size_, static_cast<size_t>(last - first)});
+    if (count == 0) {
+      return first;
+    }
+    size_t tail = Index(size_);
+    size_t chunk = std::min(count, capacity_ - tail);
+    std::memcpy(data_ + tail, &*first, chunk * sizeof(T));
+    std::memcpy(data_, &*first + chunk, (count - chunk) * sizeof(T));
+    size_ += count;
+    return first + count;
+  }
+
+  template <class OutputIterator>
+  OutputIterator PopFrontN(OutputIterator out, size_t count, std::false_type) {
+    for (; count > 0; --count) {
+      *out++ = std::move(front());
+      pop_front();
+    }
+    return out;
+  }
+
+  template <class OutputIterator>
+  OutputIterator PopFrontN(OutputIterator out, size_t count, std::true_type) {
+    if (count == 0) {
+      return out;
+    }
+    size_t chunk = std::min(count, capacity_ - head_);
+    std::memcpy(&*out, data_ + head_, chunk * sizeof(T));
+    std::memcpy(&*out + chunk, data_, (count - chunk) * sizeof(T));
+    head_ = Index(count);
+    size_ -= count;
+    return out + count;
+  }
+};
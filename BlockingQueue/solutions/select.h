@@ -0,0 +1,144 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <limits>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+enum class QueueEvent {
+  kReadable,
+  kWritable,
+};
+
+const size_t kNoQueue = std::numeric_limits<size_t>::max();
+
+// One-shot wakeup a thread parks on while it watches several queues. Queues
+// signal it under their own lock, so it never takes a queue lock itself.
+class Selector {
+public:
+  Selector()
+      : signalled_{false} {
+  }
+
+  Selector(const Selector&) = delete;
+  Selector& operator=(const Selector&) = delete;
+
+  void Reset() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    signalled_ = false;
+  }
+
+  void Notify() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    signalled_ = true;
+    cond_.notify_one();
+  }
+
+  void Wait() {
+    std::unique_lock<std::mutex> lock(mtx_);
+    cond_.wait(lock, [&] {
+      return signalled_;
+    });
+  }
+
+private:
+  bool signalled_;
+  std::mutex mtx_;
+  std::condition_variable cond_;
+};
+
+// Keeps a selector subscribed to an event of every queue for its lifetime
+template <class Queue>
+class SelectorSubscription {
+public:
+  SelectorSubscription(const std::vector<Queue*>& queues, Selector& selector, const QueueEvent event)
+      : queues_(queues)
+      , selector_(selector)
+      , event_(event) {
+    for (Queue* queue : queues_) {
+      queue->Watch(&selector_, event_);
+    }
+  }
+
+  SelectorSubscription(const SelectorSubscription&) = delete;
+  SelectorSubscription& operator=(const SelectorSubscription&) = delete;
+
+  ~SelectorSubscription() {
+    for (Queue* queue : queues_) {
+      queue->Unwatch(&selector_, event_);
+    }
+  }
+
+private:
+  const std::vector<Queue*>& queues_;
+  Selector& selector_;
+  const QueueEvent event_;
+};
+
+///////////////////////////////////////////////////////////////////////
+
+// Blocks until one of the queues has an item (kReadable) or room for one
+// (kWritable), or is shut down, and returns its index. Another thread may
+// still win the race for that item or room.
+template <class Queue>
+size_t WaitAny(const std::vector<Queue*>& queues, const QueueEvent event) {
+  Selector selector;
+  SelectorSubscription<Queue> subscription(queues, selector, event);
+  for (;;) {
+    selector.Reset();
+    for (size_t i = 0; i < queues.size(); ++i) {
+      if (queues[i]->IsReady(event)) {
+        return i;
+      }
+    }
+    selector.Wait();
+  }
+}
+
+// Takes an item from whichever queue has one first and returns its index,
+// or kNoQueue once every queue is shut down.
+template <class Queue, class T>
+size_t SelectGet(const std::vector<Queue*>& queues, T& result) {
+  Selector selector;
+  SelectorSubscription<Queue> subscription(queues, selector, QueueEvent::kReadable);
+  for (;;) {
+    selector.Reset();
+    bool all_shut_down = true;
+    for (size_t i = 0; i < queues.size(); ++i) {
+      if (queues[i]->TryGet(result)) {
+        return i;
+      }
+      all_shut_down = all_shut_down && queues[i]->IsShutdown();
+    }
+    if (all_shut_down) {
+      return kNoQueue;
+    }
+    selector.Wait();
+  }
+}
+
+// Puts the item into whichever queue has room first and returns its index,
+// or kNoQueue, leaving the item untouched, once every queue is shut down.
+template <class Queue, class T>
+size_t SelectPut(const std::vector<Queue*>& queues, T&& item) {
+  Selector selector;
+  SelectorSubscription<Queue> subscription(queues, selector, QueueEvent::kWritable);
+  for (;;) {
+    selector.Reset();
+    bool all_shut_down = true;
+    for (size_t i = 0; i < queues.size(); ++i) {
+      if (!queues[i]->IsShutdown()) {
+        all_shut_down = false;
+        if (queues[i]->TryPut(std::move(item))) {
+          return i;
+        }
+      }
+    }
+    if (all_shut_down) {
+      return kNoQueue;
+    }
+    selector.Wait();
+  }
+}
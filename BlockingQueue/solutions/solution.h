@@ -1,15 +1,31 @@
+#include "queue_stats.h"
+#include "ring_buffer.h"
+#include "select.h"
+#include "wait_strategy.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <condition_variable>
 #include <queue>
 #include <mutex>
 #include <stdexcept>
+#include <vector>
 
-template <class T, class Container = std::deque<T>>
+// StatsPolicy = QueueStats turns on the occupancy and wait-time counters
+template <class T, class Container = RingBuffer<T>, class StatsPolicy = NoQueueStats>
 class BlockingQueue {
 public:
-  explicit BlockingQueue(const size_t capacity)
+  explicit BlockingQueue(const size_t capacity, const WaitOptions& wait_options = WaitOptions())
       : blocked_{false}
-      , capacity_{capacity} {
+      , capacity_{capacity}
+      , size_{0}
+      , readers_waiting_{0}
+      , writers_waiting_{0}
+      , read_waiter_{wait_options}
+      , write_waiter_{wait_options} {
+    Reserve(data_queue_, 0);
   }
 
   void Put(T&& item) {
@@ -17,16 +33,40 @@ public:
       throw std::exception();
     }
     std::unique_lock<std::mutex> lock(mtx_);
-    if (data_queue_.size() == capacity_) {
-      write_cond_.wait(lock, [&] {
-        return data_queue_.size() < capacity_ || blocked_;
-      });
-      if (blocked_) {
-        throw std::exception();
-      }
-    }
+    WaitForRoom(lock);
     data_queue_.push_back(std::move(item));
-    read_cond_.notify_one();
+    OnItemsAdded(1);
+  }
+
+  // Constructs the item right in the queue storage
+  template <class... Args>
+  void Emplace(Args&&... args) {
+    if (blocked_) {
+      throw std::exception();
+    }
+    std::unique_lock<std::mutex> lock(mtx_);
+    WaitForRoom(lock);
+    data_queue_.emplace_back(std::forward<Args>(args)...);
+    OnItemsAdded(1);
+  }
+
+  // Moves as many items from [first, last) as fit under a single lock hold,
+  // blocking only until there is room for the first one. Returns the
+  // position of the first item left behind.
+  template <class Iterator>
+  Iterator PutMany(Iterator first, Iterator last) {
+    if (blocked_) {
+      throw std::exception();
+    }
+    if (first == last) {
+      return first;
+    }
+    std::unique_lock<std::mutex> lock(mtx_);
+    WaitForRoom(lock);
+    size_t size = data_queue_.size();
+    first = Append(data_queue_, first, last, capacity_ - size, 0);
+    OnItemsAdded(data_queue_.size() - size);
+    return first;
   }
 
   bool Get(T& result) {
@@ -34,17 +74,54 @@ public:
       return false;
     }
     std::unique_lock<std::mutex> lock(mtx_);
-    if (data_queue_.empty()) {
-      read_cond_.wait(lock, [&] {
-        return !data_queue_.empty() || blocked_;
-      });
-      if (blocked_) {
-        return false;
-      }
+    if (!WaitForItems(lock)) {
+      return false;
+    }
+    result = std::move(data_queue_.front());
+    data_queue_.pop_front();
+    OnItemsRemoved(1);
+    return true;
+  }
+
+  // Drains up to max_items into out under a single lock hold, blocking only
+  // until at least one item is available. Returns the number of items
+  // drained, 0 if the queue is shut down.
+  template <class OutputIterator>
+  size_t GetMany(OutputIterator out, const size_t max_items) {
+    if (blocked_ || max_items == 0) {
+      return 0;
+    }
+    std::unique_lock<std::mutex> lock(mtx_);
+    if (!WaitForItems(lock)) {
+      return 0;
+    }
+    size_t count = std::min(max_items, data_queue_.size());
+    PopFrontN(data_queue_, out, count, 0);
+    OnItemsRemoved(count);
+    return count;
+  }
+
+  // Never blocks. Returns false if the queue is full or shut down, leaving
+  // the item untouched.
+  bool TryPut(T&& item) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (blocked_ || data_queue_.size() == capacity_) {
+      return false;
+    }
+    data_queue_.push_back(std::move(item));
+    OnItemsAdded(1);
+    return true;
+  }
+
+  // Never blocks. Returns false if the queue is empty or shut down.
+  bool TryGet(T& result) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (blocked_ || data_queue_.empty()) {
+      return false;
     }
     result = std::move(data_queue_.front());
     data_queue_.pop_front();
-    write_cond_.notify_one();
+    OnItemsRemoved(1);
     return true;
   }
 
@@ -53,13 +130,225 @@ public:
      blocked_ = true;
      read_cond_.notify_all();
      write_cond_.notify_all();
+     NotifyWatchers(read_watchers_);
+     NotifyWatchers(write_watchers_);
+  }
+
+  bool IsShutdown() const {
+    return blocked_;
+  }
+
+  // Whether a Get (kReadable) or Put (kWritable) would return right away
+  bool IsReady(const QueueEvent event) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (event == QueueEvent::kReadable) {
+      return blocked_ || !data_queue_.empty();
+    }
+    return blocked_ || data_queue_.size() < capacity_;
+  }
+
+  // Subscribes a selector to be notified whenever the queue may have become
+  // ready for the event; used by WaitAny, SelectGet and SelectPut
+  void Watch(Selector* selector, const QueueEvent event) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    Watchers(event).push_back(selector);
+  }
+
+  // Does nothing for a selector that is not watching the event
+  void Unwatch(Selector* selector, const QueueEvent event) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto& watchers = Watchers(event);
+    auto it = std::find(watchers.begin(), watchers.end(), selector);
+    if (it != watchers.end()) {
+      watchers.erase(it);
+    }
+  }
+
+  QueueStatsSnapshot Stats() const {
+    return stats_.Snapshot();
+  }
+
+  WaitStats ReaderWaitStats() const {
+    return read_waiter_.Stats();
+  }
+
+  WaitStats WriterWaitStats() const {
+    return write_waiter_.Stats();
   }
 
 private:
+  std::atomic<bool> blocked_;
   size_t capacity_;
-  bool blocked_;
+  // mirrors data_queue_.size() for waiters spinning without the lock
+  std::atomic<size_t> size_;
+  size_t readers_waiting_;
+  size_t writers_waiting_;
   std::mutex mtx_;
   Container data_queue_;
   std::condition_variable read_cond_;
   std::condition_variable write_cond_;
+  AdaptiveWaiter read_waiter_;
+  AdaptiveWaiter write_waiter_;
+  std::vector<Selector*> read_watchers_;
+  std::vector<Selector*> write_watchers_;
+  StatsPolicy stats_;
+
+  void WaitForRoom(std::unique_lock<std::mutex>& lock) {
+    const bool full = data_queue_.size() == capacity_;
+    std::chrono::steady_clock::time_point start;
+    if (StatsPolicy::kEnabled && full) {
+      start = std::chrono::steady_clock::now();
+    }
+    if (full && write_waiter_.Enabled()) {
+      lock.unlock();
+      WaitStage stage = write_waiter_.Spin([&] {
+        return size_.load(std::memory_order_relaxed) < capacity_ || blocked_;
+      });
+      lock.lock();
+      // ready too late for the last yield counts for no stage: only a
+      // thread that really waited on the condition variable parked
+      if (stage != WaitStage::kPark && (data_queue_.size() < capacity_ || blocked_)) {
+        write_waiter_.Record(stage);
+      }
+    }
+    if (data_queue_.size() == capacity_) {
+      ++writers_waiting_;
+      write_cond_.wait(lock, [&] {
+        return data_queue_.size() < capacity_ || blocked_;
+      });
+      --writers_waiting_;
+      write_waiter_.Record(WaitStage::kPark);
+    }
+    if (StatsPolicy::kEnabled && full) {
+      stats_.OnWait(QueueSide::kPut, std::chrono::steady_clock::now() - start, blocked_);
+    }
+    if (blocked_) {
+      throw std::exception();
+    }
+  }
+
+  bool WaitForItems(std::unique_lock<std::mutex>& lock) {
+    const bool empty = data_queue_.empty();
+    std::chrono::steady_clock::time_point start;
+    if (StatsPolicy::kEnabled && empty) {
+      start = std::chrono::steady_clock::now();
+    }
+    if (empty && read_waiter_.Enabled()) {
+      lock.unlock();
+      WaitStage stage = read_waiter_.Spin([&] {
+        return size_.load(std::memory_order_relaxed) > 0 || blocked_;
+      });
+      lock.lock();
+      if (stage != WaitStage::kPark && (!data_queue_.empty() || blocked_)) {
+        read_waiter_.Record(stage);
+      }
+    }
+    if (data_queue_.empty()) {
+      ++readers_waiting_;
+      read_cond_.wait(lock, [&] {
+        return !data_queue_.empty() || blocked_;
+      });
+      --readers_waiting_;
+      read_waiter_.Record(WaitStage::kPark);
+    }
+    if (StatsPolicy::kEnabled && empty) {
+      stats_.OnWait(QueueSide::kGet, std::chrono::steady_clock::now() - start, blocked_);
+    }
+    return !blocked_;
+  }
+
+  // A batch issues a single wakeup; every woken thread hands the baton on
+  // while there is still something left for the next sleeper.
+  void WakeReader() {
+    if (readers_waiting_ > 0) {
+      read_cond_.notify_one();
+    }
+  }
+
+  void WakeWriter() {
+    if (writers_waiting_ > 0) {
+      write_cond_.notify_one();
+    }
+  }
+
+  // Containers that can preallocate or move ranges in bulk, like RingBuffer,
+  // do so; others fall back to one push_back or pop_front per item.
+  template <class C>
+  auto Reserve(C& container, int) -> decltype(container.reserve(capacity_), void()) {
+    container.reserve(capacity_);
+  }
+
+  template <class C>
+  void Reserve(C&, long) {
+  }
+
+  template <class C, class Iterator>
+  auto Append(C& container, Iterator first, Iterator last, size_t room, int)
+      -> decltype(container.append(first, last, room)) {
+    return container.append(first, last, room);
+  }
+
+  template <class C, class Iterator>
+  Iterator Append(C& container, Iterator first, Iterator last, size_t room, long) {
+    for (; first != last && room > 0; ++first, --room) {
+      container.push_back(std::move(*first));
+    }
+    return first;
+  }
+
+  template <class C, class OutputIterator>
+  auto PopFrontN(C& container, OutputIterator out, size_t count, int)
+      -> decltype(container.pop_front_n(out, count), void()) {
+    container.pop_front_n(out, count);
+  }
+
+  template <class C, class OutputIterator>
+  void PopFrontN(C& container, OutputIterator out, size_t count, long) {
+    for (; count > 0; --count) {
+      *out++ = std::move(container.front());
+      container.pop_front();
+    }
+  }
+
+  void UpdateSize() {
+    size_.store(data_queue_.size(), std::memory_order_relaxed);
+  }
+
+  void OnItemsAdded(const size_t count) {
+    stats_.OnPut(count, data_queue_.size());
+    UpdateSize();
+    WakeReader();
+    PassRoomOn();
+    NotifyWatchers(read_watchers_);
+  }
+
+  void OnItemsRemoved(const size_t count) {
+    stats_.OnGet(count, data_queue_.size());
+    UpdateSize();
+    WakeWriter();
+    PassItemsOn();
+    NotifyWatchers(write_watchers_);
+  }
+
+  std::vector<Selector*>& Watchers(const QueueEvent event) {
+    return event == QueueEvent::kReadable ? read_watchers_ : write_watchers_;
+  }
+
+  void NotifyWatchers(const std::vector<Selector*>& watchers) {
+    for (Selector* selector : watchers) {
+      selector->Notify();
+    }
+  }
+
+  void PassItemsOn() {
+    if (!data_queue_.empty()) {
+      WakeReader();
+    }
+  }
+
+  void PassRoomOn() {
+    if (data_queue_.size() < capacity_) {
+      WakeWriter();
+    }
+  }
 };
@@ -0,0 +1,261 @@
+#pragma once
+
+#include "ring_buffer.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// How SpillingBlockingQueue turns items into bytes and back. Trivially
+// copyable types work out of the box; specialize it for anything else.
+template <class T, class Enable = void>
+struct SpillSerializer;
+
+template <class T>
+struct SpillSerializer<T, typename std::enable_if<std::is_trivially_copyable<T>::value>::type> {
+  static void Serialize(const T& item, std::string& out) {
+    out.append(reinterpret_cast<const char*>(&item), sizeof(T));
+  }
+
+  static T Deserialize(const char* data, size_t) {
+    T item;
+    std::memcpy(&item, data, sizeof(T));
+    return item;
+  }
+};
+
+///////////////////////////////////////////////////////////////////////
+
+// Fixed-size memory-mapped file holding length-prefixed records. It is
+// written once front to back and then read once front to back.
+class SpillSegment {
+public:
+  SpillSegment(const std::string& path, const size_t size)
+      : path_(path)
+      , size_{size}
+      , write_offset_{0}
+      , read_offset_{0} {
+    fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd_ < 0) {
+      throw std::system_error(errno, std::generic_category(), "could not create " + path_);
+    }
+    if (::ftruncate(fd_, size_) != 0) {
+      int error = errno;
+      Remove();
+      throw std::system_error(error, std::generic_category(), "could not resize " + path_);
+    }
+    void* data = ::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (data == MAP_FAILED) {
+      int error = errno;
+      Remove();
+      throw std::system_error(error, std::generic_category(), "could not map " + path_);
+    }
+    data_ = static_cast<char*>(data);
+  }
+
+  SpillSegment(const SpillSegment&) = delete;
+  SpillSegment& operator=(const SpillSegment&) = delete;
+
+  ~SpillSegment() {
+    ::munmap(data_, size_);
+    Remove();
+  }
+
+  bool Append(const std::string& record) {
+    uint32_t length = record.size();
+    if (write_offset_ + sizeof(length) + length > size_) {
+      return false;
+    }
+    std::memcpy(data_ + write_offset_, &length, sizeof(length));
+    std::memcpy(data_ + write_offset_ + sizeof(length), record.data(), length);
+    write_offset_ += sizeof(length) + length;
+    return true;
+  }
+
+  bool Exhausted() const {
+    return read_offset_ == write_offset_;
+  }
+
+  template <class Serializer>
+  auto Read() -> decltype(Serializer::Deserialize(nullptr, 0)) {
+    uint32_t length;
+    std::memcpy(&length, data_ + read_offset_, sizeof(length));
+    const char* record = data_ + read_offset_ + sizeof(length);
+    read_offset_ += sizeof(length) + length;
+    return Serializer::Deserialize(record, length);
+  }
+
+  static size_t RecordSize(const std::string& record) {
+    return sizeof(uint32_t) + record.size();
+  }
+
+private:
+  std::string path_;
+  size_t size_;
+  int fd_;
+  char* data_;
+  size_t write_offset_;
+  size_t read_offset_;
+
+  void Remove() {
+    ::close(fd_);
+    ::unlink(path_.c_str());
+  }
+};
+
+///////////////////////////////////////////////////////////////////////
+
+// BlockingQueue whose Put never blocks on a full queue: items beyond the
+// in-memory capacity are appended to memory-mapped segment files in
+// spill_dir and streamed back into memory in FIFO order as consumers catch
+// up. Fully read segments are unmapped and deleted right away.
+template <class T, class Serializer = SpillSerializer<T>>
+class SpillingBlockingQueue {
+public:
+  SpillingBlockingQueue(const size_t capacity, const std::string& spill_dir,
+                        const size_t segment_size = 1 << 20)
+      : blocked_{false}
+      , capacity_{capacity}
+      , spill_dir_(spill_dir)
+      , segment_size_{segment_size}
+      , next_segment_{0}
+      , spilled_{0}
+      , total_spilled_{0}
+      , memory_{capacity} {
+  }
+
+  SpillingBlockingQueue(const SpillingBlockingQueue&) = delete;
+  SpillingBlockingQueue& operator=(const SpillingBlockingQueue&) = delete;
+
+  void Put(T&& item) {
+    std::string record;
+    bool serialized = false;
+    bool spilled = false;
+    // a segment this Put created while another one made room first; it is
+    // removed once mtx_ is released
+    std::unique_ptr<SpillSegment> spare;
+    std::unique_lock<std::mutex> lock(mtx_);
+    for (;;) {
+      if (blocked_) {
+        throw std::exception();
+      }
+      // once anything is on disk, newer items must queue up behind it
+      if (spilled_ == 0 && memory_.size() < capacity_) {
+        memory_.push_back(std::move(item));
+        break;
+      }
+      if (!serialized) {
+        Serializer::Serialize(item, record);
+        serialized = true;
+      }
+      spilled = !segments_.empty() && segments_.back()->Append(record);
+      if (!spilled && spare) {
+        segments_.push_back(std::move(spare));
+        spilled = segments_.back()->Append(record);
+      }
+      if (spilled) {
+        break;
+      }
+      // creating and mapping a file takes a while: readers go on meanwhile
+      size_t size = std::max(segment_size_, SpillSegment::RecordSize(record));
+      std::string path = spill_dir_ + "/segment-" + std::to_string(next_segment_++) + ".spill";
+      lock.unlock();
+      spare.reset(new SpillSegment(path, size));
+      lock.lock();
+    }
+    if (spilled) {
+      ++spilled_;
+      ++total_spilled_;
+    }
+    read_cond_.notify_one();
+  }
+
+  bool Get(T& result) {
+    // unmapped and deleted once mtx_ is released
+    std::unique_ptr<SpillSegment> retired;
+    std::unique_lock<std::mutex> lock(mtx_);
+    read_cond_.wait(lock, [&] {
+      return !memory_.empty() || spilled_ > 0 || blocked_;
+    });
+    if (blocked_) {
+      return false;
+    }
+    if (memory_.empty()) {
+      result = ReadBack(retired);
+    } else {
+      result = std::move(memory_.front());
+      memory_.pop_front();
+      if (spilled_ > 0) {
+        memory_.push_back(ReadBack(retired));
+      }
+    }
+    return true;
+  }
+
+  void Shutdown() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    blocked_ = true;
+    read_cond_.notify_all();
+  }
+
+  // Items currently on disk
+  size_t Spilled() const {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return spilled_;
+  }
+
+  // Items that ever went through disk
+  size_t TotalSpilled() const {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return total_spilled_;
+  }
+
+  // Segment files currently mapped
+  size_t Segments() const {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return segments_.size();
+  }
+
+private:
+  bool blocked_;
+  const size_t capacity_;
+  const std::string spill_dir_;
+  const size_t segment_size_;
+  size_t next_segment_;
+  size_t spilled_;
+  size_t total_spilled_;
+  mutable std::mutex mtx_;
+  std::condition_variable read_cond_;
+  RingBuffer<T> memory_;
+  std::deque<std::unique_ptr<SpillSegment>> segments_;
+
+  // A segment read to the end goes to retired, unless it is the last one
+  // and may still take records
+  T ReadBack(std::unique_ptr<SpillSegment>& retired) {
+    while (segments_.front()->Exhausted()) {
+      retired = std::move(segments_.front());
+      segments_.pop_front();
+    }
+    T item = segments_.front()->template Read<Serializer>();
+    --spilled_;
+    if (segments_.front()->Exhausted() && segments_.size() > 1) {
+      retired = std::move(segments_.front());
+      segments_.pop_front();
+    }
+    return item;
+  }
+};
@@ -0,0 +1,145 @@
+#pragma once
+
+#include "event_count.h"
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+// Bounded wait-free ring for exactly one producer and one consumer thread.
+// Each side owns its index and keeps a cached copy of the other side's one
+// on its own cache line, so a Put or Get touches shared memory only when
+// the cached view says the ring is full or empty. Threads park only then.
+template <class T>
+class SPSCBlockingQueue {
+public:
+  explicit SPSCBlockingQueue(const size_t capacity)
+      : capacity_{capacity}
+      , mask_{RoundUpToPowerOfTwo(capacity) - 1}
+      , slots_{new Slot[mask_ + 1]}
+      , closed_{false}
+      , head_{0}
+      , tail_cache_{0}
+      , tail_{0}
+      , head_cache_{0} {
+    if (capacity_ == 0) {
+      throw std::invalid_argument("capacity must be positive");
+    }
+  }
+
+  SPSCBlockingQueue(const SPSCBlockingQueue&) = delete;
+  SPSCBlockingQueue& operator=(const SPSCBlockingQueue&) = delete;
+
+  ~SPSCBlockingQueue() {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    for (size_t pos = head_.load(std::memory_order_relaxed); pos != tail; ++pos) {
+      slots_[pos & mask_].Item()->~T();
+    }
+  }
+
+  void Put(T&& item) {
+    for (;;) {
+      if (closed_.load(std::memory_order_acquire)) {
+        throw std::exception();
+      }
+      if (TryPut(std::move(item))) {
+        return;
+      }
+      size_t tail = tail_.load(std::memory_order_relaxed);
+      not_full_.Wait([&] {
+        return closed_.load(std::memory_order_seq_cst) ||
+               tail - head_.load(std::memory_order_seq_cst) < capacity_;
+      });
+    }
+  }
+
+  bool Get(T& result) {
+    for (;;) {
+      if (closed_.load(std::memory_order_acquire)) {
+        return false;
+      }
+      if (TryGet(result)) {
+        return true;
+      }
+      size_t head = head_.load(std::memory_order_relaxed);
+      not_empty_.Wait([&] {
+        return closed_.load(std::memory_order_seq_cst) ||
+               tail_.load(std::memory_order_seq_cst) != head;
+      });
+    }
+  }
+
+  void Shutdown() {
+    closed_.store(true, std::memory_order_seq_cst);
+    not_empty_.NotifyAll();
+    not_full_.NotifyAll();
+  }
+
+  // Producer side only
+  bool TryPut(T&& item) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_cache_ >= capacity_) {
+      head_cache_ = head_.load(std::memory_order_acquire);
+      if (tail - head_cache_ >= capacity_) {
+        return false;
+      }
+    }
+    new (slots_[tail & mask_].Item()) T(std::move(item));
+    tail_.store(tail + 1, std::memory_order_seq_cst);
+    not_empty_.NotifyOne();
+    return true;
+  }
+
+  // Consumer side only
+  bool TryGet(T& result) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_cache_) {
+      tail_cache_ = tail_.load(std::memory_order_acquire);
+      if (head == tail_cache_) {
+        return false;
+      }
+    }
+    T* item = slots_[head & mask_].Item();
+    result = std::move(*item);
+    item->~T();
+    head_.store(head + 1, std::memory_order_seq_cst);
+    not_full_.NotifyOne();
+    return true;
+  }
+
+private:
+  struct Slot {
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+
+    T* Item() {
+      return reinterpret_cast<T*>(&storage);
+    }
+  };
+
+  static size_t RoundUpToPowerOfTwo(size_t n) {
+    size_t power = 1;
+    while (power < n) {
+      power <<= 1;
+    }
+    return power;
+  }
+
+  const size_t capacity_;
+  const size_t mask_;
+  std::unique_ptr<Slot[]> slots_;
+  std::atomic<bool> closed_;
+  EventCount not_empty_;
+  EventCount not_full_;
+
+  // consumer's line
+  alignas(kCacheLineSize) std::atomic<size_t> head_;
+  size_t tail_cache_;
+
+  // producer's line
+  alignas(kCacheLineSize) std::atomic<size_t> tail_;
+  size_t head_cache_;
+};
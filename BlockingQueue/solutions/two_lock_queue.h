@@ -0,0 +1,133 @@
+#pragma once
+
+#include "event_count.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+// Michael-Scott two-lock linked queue made blocking. Producers only take
+// put_mtx_ to append at tail_, consumers only take take_mtx_ to unlink at
+// head_, and the occupancy is an atomic counter, so a producer and a
+// consumer never contend unless one of them has to wake the other up.
+template <class T>
+class TwoLockBlockingQueue {
+public:
+  explicit TwoLockBlockingQueue(const size_t capacity)
+      : capacity_{capacity}
+      , blocked_{false}
+      , count_{0}
+      , head_{new Node}
+      , tail_{head_} {
+  }
+
+  TwoLockBlockingQueue(const TwoLockBlockingQueue&) = delete;
+  TwoLockBlockingQueue& operator=(const TwoLockBlockingQueue&) = delete;
+
+  ~TwoLockBlockingQueue() {
+    while (Node* first = head_->next) {
+      first->Item()->~T();
+      delete head_;
+      head_ = first;
+    }
+    delete head_;
+  }
+
+  void Put(T&& item) {
+    if (blocked_) {
+      throw std::exception();
+    }
+    Node* node = new Node;
+    new (node->Item()) T(std::move(item));
+    size_t count;
+    {
+      std::unique_lock<std::mutex> lock(put_mtx_);
+      not_full_.wait(lock, [&] {
+        return count_ < capacity_ || blocked_;
+      });
+      if (blocked_) {
+        node->Item()->~T();
+        delete node;
+        throw std::exception();
+      }
+      tail_->next = node;
+      tail_ = node;
+      count = count_.fetch_add(1);
+      if (count + 1 < capacity_) {
+        not_full_.notify_one();
+      }
+    }
+    if (count == 0) {
+      std::lock_guard<std::mutex> lock(take_mtx_);
+      not_empty_.notify_one();
+    }
+  }
+
+  bool Get(T& result) {
+    if (blocked_) {
+      return false;
+    }
+    Node* dummy;
+    size_t count;
+    {
+      std::unique_lock<std::mutex> lock(take_mtx_);
+      not_empty_.wait(lock, [&] {
+        return count_ > 0 || blocked_;
+      });
+      if (blocked_) {
+        return false;
+      }
+      dummy = head_;
+      head_ = head_->next;
+      result = std::move(*head_->Item());
+      head_->Item()->~T();
+      count = count_.fetch_sub(1);
+      if (count > 1) {
+        not_empty_.notify_one();
+      }
+    }
+    delete dummy;
+    if (count == capacity_) {
+      std::lock_guard<std::mutex> lock(put_mtx_);
+      not_full_.notify_one();
+    }
+    return true;
+  }
+
+  void Shutdown() {
+    std::lock(put_mtx_, take_mtx_);
+    std::lock_guard<std::mutex> put_lock(put_mtx_, std::adopt_lock);
+    std::lock_guard<std::mutex> take_lock(take_mtx_, std::adopt_lock);
+    blocked_ = true;
+    not_full_.notify_all();
+    not_empty_.notify_all();
+  }
+
+private:
+  // head_ always points to a dummy node whose item is already taken
+  struct Node {
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    Node* next = nullptr;
+
+    T* Item() {
+      return reinterpret_cast<T*>(&storage);
+    }
+  };
+
+  const size_t capacity_;
+  std::atomic<bool> blocked_;
+  std::atomic<size_t> count_;
+
+  alignas(kCacheLineSize) std::mutex take_mtx_;
+  std::condition_variable not_empty_;
+  Node* head_;
+
+  alignas(kCacheLineSize) std::mutex put_mtx_;
+  std::condition_variable not_full_;
+  Node* tail_;
+};
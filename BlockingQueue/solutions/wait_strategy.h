@@ -0,0 +1,113 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+
+inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////
+
+// How a blocked Put or Get waits before parking on a condition variable.
+// The defaults park right away.
+struct WaitOptions {
+  size_t min_spins = 0;
+  size_t max_spins = 0;
+  size_t yields = 0;
+};
+
+// How many waits were resolved by each stage
+struct WaitStats {
+  size_t spun = 0;
+  size_t yielded = 0;
+  size_t parked = 0;
+};
+
+enum class WaitStage {
+  kSpin,
+  kYield,
+  kPark,
+};
+
+// Spins with a budget that doubles whenever spinning was enough and halves
+// whenever the waiter had to yield or park, then yields a fixed number of
+// times. Parking itself is left to the caller.
+class AdaptiveWaiter {
+public:
+  explicit AdaptiveWaiter(const WaitOptions& options)
+      : options_(options)
+      , spin_budget_{options.max_spins}
+      , spun_{0}
+      , yielded_{0}
+      , parked_{0} {
+  }
+
+  bool Enabled() const {
+    return options_.max_spins > 0 || options_.yields > 0;
+  }
+
+  template <class Predicate>
+  WaitStage Spin(Predicate ready) const {
+    size_t spins = spin_budget_.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < spins; ++i) {
+      if (ready()) {
+        return WaitStage::kSpin;
+      }
+      CpuRelax();
+    }
+    for (size_t i = 0; i < options_.yields; ++i) {
+      if (ready()) {
+        return WaitStage::kYield;
+      }
+      std::this_thread::yield();
+    }
+    return WaitStage::kPark;
+  }
+
+  void Record(const WaitStage stage) {
+    size_t spins = spin_budget_.load(std::memory_order_relaxed);
+    switch (stage) {
+      case WaitStage::kSpin:
+        spun_.fetch_add(1, std::memory_order_relaxed);
+        spins = std::min(options_.max_spins, spins * 2);
+        break;
+      case WaitStage::kYield:
+        yielded_.fetch_add(1, std::memory_order_relaxed);
+        spins = std::max(MinSpins(), spins / 2);
+        break;
+      case WaitStage::kPark:
+        parked_.fetch_add(1, std::memory_order_relaxed);
+        spins = std::max(MinSpins(), spins / 2);
+        break;
+    }
+    spin_budget_.store(spins, std::memory_order_relaxed);
+  }
+
+  WaitStats Stats() const {
+    WaitStats stats;
+    stats.spun = spun_.load(std::memory_order_relaxed);
+    stats.yielded = yielded_.load(std::memory_order_relaxed);
+    stats.parked = parked_.load(std::memory_order_relaxed);
+    return stats;
+  }
+
+private:
+  const WaitOptions options_;
+
+  // never shrink to zero, or spinning could not win the budget back
+  size_t MinSpins() const {
+    return std::min(options_.max_spins, std::max<size_t>(options_.min_spins, 1));
+  }
+
+  std::atomic<size_t> spin_budget_;
+  std::atomic<size_t> spun_;
+  std::atomic<size_t> yielded_;
+  std::atomic<size_t> parked_;
+};
@@ -1,12 +1,27 @@
 #include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <array>
 #include <deque>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <numeric>
 #include <string>
 #include <vector>
 #include <sstream>
 
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "test_utils.h"
 #include "solution.h"
+#include "parallel_algorithms.h"
+#include "strand.h"
+#include "task_graph.h"
+#include "coroutine.h"
 //#include "ya_contest_sim.h"
 
 namespace PoolTests {
@@ -93,10 +108,57 @@ namespace PoolTests {
         }
     };
 
-    void do_test_pool(const TestPoolOpts& opts) {
-        std::cout << "Testing with parameters: " << opts.to_string() << std::endl;
+    // Sums [first, last) by recursive halving, every level waiting on a TaskGroup
+    size_t sum_range(ThreadPool& pool, size_t first, size_t last) {
+        if (last - first <= 16) {
+            size_t sum = 0;
+            for (size_t i = first; i < last; ++i) {
+                sum += i;
+            }
+            return sum;
+        }
+        size_t middle = first + (last - first) / 2;
+        size_t left = 0;
+        size_t right = 0;
+        TaskGroup group(pool);
+        group.Run([&]() {
+            left = sum_range(pool, first, middle);
+        });
+        group.Run([&]() {
+            right = sum_range(pool, middle, last);
+        });
+        group.Wait();
+        return left + right;
+    }
+
+    void do_test_task() {
+        std::cout << "Testing task storage ... " << std::endl;
+
+        size_t calls = 0;
+        Task small([&calls]() {
+            ++calls;
+        });
+        test_assert(small.IsInline(), "small callable stored on the heap");
+
+        std::array<size_t, 2 * Task::kInlineSize> big{};
+        Task large([&calls, big]() {
+            calls += big.size();
+        });
+        test_assert(!large.IsInline(), "large callable stored inline");
+
+        Task moved(std::move(small));
+        test_assert(!small && moved.IsInline(), "task not moved");
+        moved();
+        large();
+        test_assert(calls == 1 + big.size(), "task not run");
+
+        std::cout << "OK" << std::endl;
+    }
+
+    void do_test_pool(const TestPoolOpts& opts, const ThreadPoolOptions& pool_options, const std::string& name) {
+        std::cout << "Testing " << name << " with parameters: " << opts.to_string() << std::endl;
 
-        ThreadPool<Value> pool{opts.n_workers};
+        ThreadPool pool{opts.n_workers, pool_options};
 
         std::cout << "Testing exception resilency ... " << std::endl;
         {
@@ -136,6 +198,200 @@ namespace PoolTests {
         }
         std::cout << "Done" << std::endl;
 
+        std::cout << "Testing move-only tasks and arguments ... " << std::endl;
+        {
+            std::vector<std::future<Value>> futures;
+            for (size_t i = 0; i < opts.n_items; ++i) {
+                if (i % 2) {
+                    std::unique_ptr<size_t> boxed(new size_t(i));
+                    futures.push_back(pool.Submit([boxed = std::move(boxed)]() {
+                        return Value(*boxed, std::to_string(*boxed));
+                    }));
+                } else {
+                    futures.push_back(pool.Submit([](size_t n, const std::string& s) {
+                        return Value(n, s);
+                    }, i, std::to_string(i)));
+                }
+            }
+            check_results(futures);
+        }
+        std::cout << "Done" << std::endl;
+
+        std::cout << "Testing nested submission ... " << std::endl;
+        {
+            // every worker task fans out a slice of the items from inside the pool
+            std::mutex mtx;
+            std::vector<std::future<Value>> inner;
+            std::vector<std::future<Value>> outer;
+            size_t slice = (opts.n_items + opts.n_workers - 1) / opts.n_workers;
+            for (size_t w = 0; w < opts.n_workers; ++w) {
+                outer.push_back(pool.Submit([w, slice, &pool, &mtx, &inner, &opts]() {
+                    for (size_t i = w * slice; i < std::min((w + 1) * slice, opts.n_items); ++i) {
+                        auto future = pool.Submit([i]() {
+                            return Value(i, std::to_string(i));
+                        });
+                        std::lock_guard<std::mutex> lock(mtx);
+                        inner.push_back(std::move(future));
+                    }
+                    return Value(w, std::to_string(w));
+                }));
+            }
+            check_results(outer);
+            check_results(inner);
+        }
+        std::cout << "Done" << std::endl;
+
+        std::cout << "Testing batch submission ... " << std::endl;
+        {
+            std::vector<Value> results(opts.n_items);
+            std::vector<std::function<void()>> tasks;
+            for (size_t i = 0; i < opts.n_items; ++i) {
+                tasks.push_back([i, &results]() {
+                    results[i] = Value(i, std::to_string(i));
+                });
+            }
+            pool.SubmitBatch(std::move(tasks)).get();
+            validate_results(results);
+
+            std::vector<std::function<void()>> failing;
+            for (size_t i = 0; i < opts.n_workers; ++i) {
+                failing.push_back([i]() {
+                    if (i == 0) {
+                        throw ValueException(Value(i, std::to_string(i)));
+                    }
+                });
+            }
+            bool thrown = false;
+            try {
+                pool.SubmitBatch(std::move(failing)).get();
+            } catch (const ValueException&) {
+                thrown = true;
+            }
+            test_assert(thrown, "expected exception");
+        }
+        std::cout << "Done" << std::endl;
+
+        std::cout << "Testing parallel for ... " << std::endl;
+        {
+            for (LoopSchedule schedule : {LoopSchedule::kStatic, LoopSchedule::kDynamic, LoopSchedule::kGuided}) {
+                std::vector<size_t> hits(opts.n_items);
+                pool.ParallelFor(0, opts.n_items, 7, [&hits](size_t i) {
+                    ++hits[i];
+                }, schedule);
+                test_assert(std::count(hits.begin(), hits.end(), 1) == static_cast<ptrdiff_t>(opts.n_items),
+                            "every index must be visited exactly once");
+
+                bool thrown = false;
+                try {
+                    pool.ParallelFor(0, opts.n_items, 1, [&opts](size_t i) {
+                        if (i == opts.n_items / 2) {
+                            throw ValueException(Value(i, std::to_string(i)));
+                        }
+                    }, schedule);
+                } catch (const ValueException&) {
+                    thrown = true;
+                }
+                test_assert(thrown, "expected exception");
+            }
+        }
+        std::cout << "Done" << std::endl;
+
+        std::cout << "Testing continuations ... " << std::endl;
+        {
+            std::vector<PoolFuture<Value>> futures;
+            for (size_t i = 0; i < opts.n_items; ++i) {
+                futures.push_back(pool.Async([](size_t n) {
+                    return n;
+                }, i).Then([](size_t n) {
+                    return Value(n, std::to_string(n));
+                }));
+            }
+            std::vector<Value> results = WhenAll(std::move(futures)).Get();
+            validate_results(results);
+
+            std::atomic_size_t skipped{0};
+            auto failed = pool.Async([]() -> size_t {
+                throw ValueException(Value(0, "0"));
+            }).Then([&skipped](size_t n) {
+                skipped += 1;
+                return n;
+            }).Then([](size_t n) {
+                return Value(n, std::to_string(n));
+            });
+            bool thrown = false;
+            try {
+                failed.Get();
+            } catch (const ValueException&) {
+                thrown = true;
+            }
+            test_assert(thrown && skipped == 0, "error did not propagate past the continuations");
+
+            std::atomic_size_t count{0};
+            std::vector<PoolFuture<void>> stages;
+            for (size_t i = 0; i < opts.n_workers; ++i) {
+                stages.push_back(pool.Async([&count]() {
+                    count += 1;
+                }).Then([&count]() {
+                    count += 1;
+                }));
+            }
+            WhenAll(std::move(stages)).Get();
+            test_assert(count == 2 * opts.n_workers, "continuation not run");
+
+            std::vector<PoolFuture<Value>> racing;
+            for (size_t i = 0; i < opts.n_workers; ++i) {
+                racing.push_back(pool.Async([i]() {
+                    return Value(i, std::to_string(i));
+                }));
+            }
+            std::pair<size_t, Value> first = WhenAny(std::move(racing)).Get();
+            test_assert(first.first == first.second.first && first.first < opts.n_workers, "invalid result");
+
+            // the first result wins, later ones are ignored
+            FutureState<size_t> state;
+            state.SetValue(size_t(1));
+            state.SetException(std::make_exception_ptr(ValueException(Value(0, "0"))));
+            state.SetValue(size_t(2));
+            test_assert(state.Ready() && !state.Error() && state.Take() == 1, "future state overwritten");
+        }
+        std::cout << "Done" << std::endl;
+
+        std::cout << "Testing task groups ... " << std::endl;
+        {
+            // nested waits on a single worker only finish if waiting helps
+            size_t sum = pool.Submit(sum_range, std::ref(pool), 0, opts.n_items).get();
+            test_assert(sum == opts.n_items * (opts.n_items - 1) / 2, "invalid sum");
+
+            TaskGroup group(pool);
+            for (size_t i = 0; i < opts.n_workers; ++i) {
+                group.Run([i]() {
+                    if (i == 0) {
+                        throw ValueException(Value(i, std::to_string(i)));
+                    }
+                });
+            }
+            bool thrown = false;
+            try {
+                group.Wait();
+            } catch (const ValueException&) {
+                thrown = true;
+            }
+            test_assert(thrown, "expected exception");
+
+            // a short-lived group is gone as soon as Wait returns, while the
+            // last task may still be finishing
+            for (size_t i = 0; i < opts.n_items; ++i) {
+                size_t ran = 0;
+                TaskGroup group(pool);
+                group.Run([&ran]() {
+                    ++ran;
+                });
+                group.Wait();
+                test_assert(ran == 1, "task group did not run");
+            }
+        }
+        std::cout << "Done" << std::endl;
+
         std::cout << "Testing shutdown ... " << std::endl;
         {
             Barrier min_threads{std::min(opts.n_workers, opts.n_items)};
@@ -168,10 +424,1111 @@ namespace PoolTests {
         std::cout << "OK" << std::endl;
     }
 
+    void do_test_elastic(const TestPoolOpts& opts, SchedulingMode scheduling, const std::string& name) {
+        std::cout << "Testing elastic " << name << " ... " << std::endl;
+
+        ThreadPoolOptions options;
+        options.scheduling = scheduling;
+        options.max_workers = opts.n_workers + 1;
+        options.grow_queue_depth = 1;
+        options.idle_timeout = std::chrono::milliseconds(10);
+        ThreadPool pool{1, options};
+
+        // the barrier only opens once the pool has grown to its maximum
+        Barrier all_workers{options.max_workers};
+        std::vector<std::future<void>> futures;
+        for (size_t i = 0; i < options.max_workers; ++i) {
+            futures.push_back(pool.Submit([&all_workers]() {
+                all_workers.wait();
+            }));
+        }
+        for (auto& future : futures) {
+            future.get();
+        }
+        ThreadPoolScalingStats stats = pool.ScalingStats();
+        size_t grown = stats.grown_for_depth + stats.grown_for_age;
+        test_assert(stats.peak_workers == options.max_workers, "pool did not grow to its maximum");
+        test_assert(grown >= options.max_workers - 1, "growth not recorded");
+
+        // idle workers retire down to the initial size
+        for (size_t i = 0; i < 1000 && pool.ScalingStats().live_workers > 1; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        stats = pool.ScalingStats();
+        grown = stats.grown_for_depth + stats.grown_for_age;
+        test_assert(stats.live_workers == 1 && stats.retired == grown, "idle workers did not retire");
+
+        auto result = pool.Submit([]() {
+            return Value(0, "0");
+        });
+        test_assert(result.get().second == "0", "invalid result");
+
+        // with its only worker stuck and nothing else submitted, a single
+        // queued task grows the pool once it is old enough
+        ThreadPoolOptions aged;
+        aged.scheduling = scheduling;
+        aged.max_workers = 2;
+        aged.grow_queue_depth = 1000;
+        aged.grow_queue_age = std::chrono::milliseconds(20);
+        ThreadPool stuck{1, aged};
+        std::promise<void> gate;
+        std::atomic_bool blocked{false};
+        auto blocker = stuck.Submit([&blocked, opened = gate.get_future()]() {
+            blocked = true;
+            opened.wait();
+        });
+        while (!blocked) {
+            std::this_thread::yield();
+        }
+        auto late = stuck.Submit([]() {
+            return 1;
+        });
+        test_assert(late.wait_for(std::chrono::seconds(10)) == std::future_status::ready, "backlog age did not grow the pool");
+        test_assert(late.get() == 1, "invalid result");
+        test_assert(stuck.ScalingStats().grown_for_age == 1, "growth not recorded");
+        gate.set_value();
+        blocker.get();
+
+        std::cout << "OK" << std::endl;
+    }
+
+    void do_test_metrics(const TestPoolOpts& opts, SchedulingMode scheduling, const std::string& name) {
+        std::cout << "Testing metrics of " << name << " ... " << std::endl;
+
+        {
+            ThreadPool pool{opts.n_workers};
+            test_assert(!pool.Metrics().enabled, "metrics collected by default");
+        }
+
+        ThreadPoolOptions options;
+        options.scheduling = scheduling;
+        options.collect_metrics = true;
+        ThreadPool pool{opts.n_workers, options};
+
+        // gated tasks pile up in the queue
+        std::promise<void> gate;
+        std::shared_future<void> opened = gate.get_future().share();
+        std::vector<std::future<void>> futures;
+        for (size_t i = 0; i < opts.n_items; ++i) {
+            futures.push_back(pool.Submit([opened]() {
+                opened.wait();
+            }));
+        }
+        ThreadPoolMetrics running = pool.Metrics();
+        test_assert(running.enabled, "metrics not collected");
+        test_assert(running.completed + running.queue_depth + opts.n_workers >= opts.n_items, "invalid queue depth");
+        gate.set_value();
+        for (auto& future : futures) {
+            future.get();
+        }
+        pool.Shutdown();
+
+        ThreadPoolMetrics metrics = pool.Metrics();
+        test_assert(metrics.queue_depth == 0, "invalid queue depth");
+        test_assert(metrics.completed == opts.n_items, "invalid number of completed tasks");
+        test_assert(metrics.queue_wait.count == opts.n_items && metrics.run_time.count == opts.n_items,
+                    "invalid histogram");
+        test_assert(metrics.run_time.Quantile(0.5) <= metrics.run_time.Quantile(0.99)
+                    && metrics.run_time.Quantile(0.99) <= metrics.run_time.max, "invalid quantiles");
+        test_assert(metrics.workers.size() == opts.n_workers, "invalid number of workers");
+        size_t tasks = 0;
+        for (const auto& worker : metrics.workers) {
+            test_assert(worker.BusyRatio() >= 0.0 && worker.BusyRatio() <= 1.0, "invalid busy ratio");
+            tasks += worker.tasks;
+        }
+        test_assert(tasks == opts.n_items, "invalid tasks per worker");
+        test_assert(metrics.steals <= metrics.completed, "invalid number of steals");
+
+        if (scheduling == SchedulingMode::kWorkStealing) {
+            // rounds of nested tasks reuse the deque nodes of the first one
+            ThreadPool nesting{opts.n_workers, options};
+            const size_t fan_out = 64;
+            std::atomic_size_t ran{0};
+            nesting.Submit([&nesting, &ran, &opts, fan_out]() {
+                for (size_t round = 0; round * fan_out < opts.n_items; ++round) {
+                    TaskGroup group(nesting);
+                    for (size_t i = 0; i < fan_out; ++i) {
+                        group.Run([&ran]() {
+                            ++ran;
+                        });
+                    }
+                    group.Wait();
+                }
+            }).get();
+            test_assert(ran.load() >= opts.n_items, "nested task not run");
+            size_t nodes = nesting.Metrics().task_nodes;
+            test_assert(nodes > 0 && nodes <= fan_out, "deque nodes not reused: " << nodes);
+        }
+
+        std::cout << "OK" << std::endl;
+    }
+
+    void do_test_timers(const TestPoolOpts& opts) {
+        std::cout << "Testing timers ... " << std::endl;
+
+        {
+            // deadlines up to 2^30 ticks cover every level and the overflow
+            TimingWheel wheel;
+            std::vector<TimerNode> nodes(opts.n_items);
+            for (size_t i = 0; i < nodes.size(); ++i) {
+                wheel.Schedule(&nodes[i], (i * 2654435761u) % (uint64_t(1) << 30));
+            }
+            size_t cancelled = 0;
+            for (size_t i = 0; i < nodes.size(); i += 3) {
+                wheel.Cancel(&nodes[i]);
+                ++cancelled;
+            }
+            size_t expired = 0;
+            for (uint64_t tick = 0; !wheel.Empty(); tick += uint64_t(1) << 20) {
+                wheel.Advance(tick, [&wheel, &expired](TimerNode* node) {
+                    test_assert(node->deadline == wheel.Now(), "timer expired at the wrong tick");
+                    ++expired;
+                });
+            }
+            test_assert(expired + cancelled == nodes.size(), "invalid number of expired timers");
+            test_assert(wheel.NextEvent() == TimingWheel::kNever, "empty wheel has events");
+        }
+
+        ThreadPool pool{opts.n_workers};
+        size_t n_timers = std::min<size_t>(opts.n_items, 1000);
+        auto start = std::chrono::steady_clock::now();
+        std::atomic_size_t fired{0};
+        std::promise<void> all_fired;
+        for (size_t i = 0; i < n_timers; ++i) {
+            auto delay = std::chrono::milliseconds(i % 20);
+            pool.SubmitAfter(delay, [&, delay]() {
+                test_assert(std::chrono::steady_clock::now() - start >= delay, "timer fired early");
+                if (fired.fetch_add(1) + 1 == n_timers) {
+                    all_fired.set_value();
+                }
+            });
+        }
+        pool.SubmitAfter(std::chrono::milliseconds(0), []() {
+            throw ValueException(Value());
+        });
+
+        std::vector<TimerHandle> handles;
+        for (size_t i = 0; i < n_timers; ++i) {
+            handles.push_back(pool.SubmitAfter(std::chrono::hours(1), []() {
+                test_assert(false, "cancelled timer fired");
+            }));
+        }
+        for (auto& handle : handles) {
+            test_assert(handle.Cancel(), "pending timer not cancelled");
+            test_assert(!handle.Cancel(), "timer cancelled twice");
+        }
+        all_fired.get_future().get();
+
+        std::atomic_size_t ticks{0};
+        TimerHandle every = pool.SubmitEvery(std::chrono::milliseconds(1), [&ticks]() {
+            ++ticks;
+        });
+        while (ticks < 5) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        test_assert(every.Cancel(), "periodic timer not cancelled");
+        size_t cancelled_at = ticks;
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        test_assert(ticks <= cancelled_at + 1, "cancelled periodic timer still runs");
+
+        // shutdown drops timers that are still pending
+        auto token = std::make_shared<int>(0);
+        pool.SubmitAfter(std::chrono::hours(1), [token]() {});
+        pool.Shutdown();
+        test_assert(token.use_count() == 1, "pending timer not dropped");
+        bool thrown = false;
+        try {
+            pool.SubmitAfter(std::chrono::milliseconds(0), []() {});
+        } catch (const std::exception&) {
+            thrown = true;
+        }
+        test_assert(thrown, "expected exception");
+
+        std::cout << "OK" << std::endl;
+    }
+
+    void do_test_algorithms(const TestPoolOpts& opts) {
+        std::cout << "Testing parallel algorithms ... " << std::endl;
+
+        ThreadPool pool{opts.n_workers};
+        ThreadPool single{1};
+        std::vector<size_t> items(opts.n_items);
+        size_t seed = 42;
+        for (auto& item : items) {
+            seed = seed * 6364136223846793005u + 1442695040888963407u;
+            item = seed >> 40;
+        }
+
+        for (size_t grain : {size_t(0), size_t(1), size_t(100)}) {
+            std::vector<size_t> sorted = items;
+            std::sort(sorted.begin(), sorted.end());
+            std::vector<size_t> result = items;
+            Parallel::Sort(pool, result.begin(), result.end(), std::less<size_t>(), grain);
+            test_assert(result == sorted, "invalid sort");
+            std::reverse(sorted.begin(), sorted.end());
+            Parallel::Sort(pool, result.begin(), result.end(), std::greater<size_t>(), grain);
+            test_assert(result == sorted, "invalid sort");
+
+            size_t sum = std::accumulate(items.begin(), items.end(), size_t(0));
+            test_assert(Parallel::Reduce(pool, items.begin(), items.end(), size_t(0), std::plus<>(), grain) == sum,
+                        "invalid reduce");
+            auto square = [](size_t item) {
+                return item * item;
+            };
+            size_t squares = 0;
+            for (size_t item : items) {
+                squares += square(item);
+            }
+            test_assert(Parallel::TransformReduce(pool, items.begin(), items.end(), size_t(0), std::plus<>(), square,
+                                                  grain) == squares, "invalid transform reduce");
+
+            // not commutative: chunks must be combined in order
+            std::vector<std::string> words;
+            std::string sentence;
+            for (size_t i = 0; i < items.size(); ++i) {
+                words.push_back(std::to_string(i % 10));
+                sentence += words.back();
+            }
+            test_assert(Parallel::Reduce(pool, words.begin(), words.end(), std::string(), std::plus<>(), grain)
+                        == sentence, "invalid reduce");
+
+            // same grouping whatever the number of workers
+            std::vector<double> reals(items.begin(), items.end());
+            for (auto& real : reals) {
+                real = 1.0 / (1.0 + real);
+            }
+            test_assert(Parallel::Reduce(pool, reals.begin(), reals.end(), 0.0, std::plus<>(), grain)
+                        == Parallel::Reduce(single, reals.begin(), reals.end(), 0.0, std::plus<>(), grain),
+                        "reduce is not deterministic");
+
+            std::vector<size_t> prefix(items.size());
+            std::partial_sum(items.begin(), items.end(), prefix.begin());
+            result.assign(items.size(), 0);
+            test_assert(Parallel::InclusiveScan(pool, items.begin(), items.end(), result.begin(), std::plus<>(), grain)
+                        == result.end(), "invalid scan");
+            test_assert(result == prefix, "invalid scan");
+            result = items;
+            Parallel::InclusiveScan(pool, result.begin(), result.end(), result.begin(), std::plus<>(), grain);
+            test_assert(result == prefix, "invalid in-place scan");
+
+            result = items;
+            Parallel::ForEach(pool, result.begin(), result.end(), [](size_t& item) {
+                item = item * 2 + 1;
+            }, grain);
+            for (size_t i = 0; i < items.size(); ++i) {
+                test_assert(result[i] == items[i] * 2 + 1, "invalid for each");
+            }
+        }
+
+        bool thrown = false;
+        try {
+            Parallel::ForEach(pool, items.begin(), items.end(), [&items](size_t& item) {
+                if (&item == &items.back()) {
+                    throw ValueException(Value());
+                }
+            }, 1);
+        } catch (const ValueException&) {
+            thrown = true;
+        }
+        test_assert(thrown, "expected exception");
+
+        std::cout << "OK" << std::endl;
+    }
+
+    void do_test_strands(const TestPoolOpts& opts) {
+        std::cout << "Testing strands ... " << std::endl;
+
+        ThreadPool pool{opts.n_workers};
+        {
+            size_t n_keys = 2 * opts.n_workers;
+            KeyedExecutor<size_t> executor(pool);
+            // written without locks: a key's tasks never overlap
+            std::vector<std::vector<size_t>> seen(n_keys);
+            std::vector<std::atomic_bool> running(n_keys);
+            std::vector<std::future<void>> futures;
+            for (size_t i = 0; i < opts.n_items; ++i) {
+                size_t key = i % n_keys;
+                futures.push_back(executor.Submit(key, [&seen, &running, key, i]() {
+                    test_assert(!running[key].exchange(true), "tasks of a key overlap");
+                    seen[key].push_back(i);
+                    running[key] = false;
+                }));
+            }
+            for (auto& future : futures) {
+                future.get();
+            }
+            size_t total = 0;
+            for (const auto& items : seen) {
+                test_assert(std::is_sorted(items.begin(), items.end()), "tasks of a key out of order");
+                total += items.size();
+            }
+            test_assert(total == opts.n_items, "invalid number of tasks");
+            for (size_t i = 0; i < 1000 && executor.ActiveKeys() > 0; ++i) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            test_assert(executor.ActiveKeys() == 0, "idle keys still tracked");
+
+            if (opts.n_workers > 1) {
+                // only opens if two keys run at once
+                Barrier both{2};
+                auto first = executor.Submit(0, [&both]() {
+                    both.wait();
+                });
+                auto second = executor.Submit(1, [&both]() {
+                    both.wait();
+                });
+                first.get();
+                second.get();
+            }
+        }
+
+        Strand strand(pool);
+        std::vector<std::future<Value>> futures;
+        size_t next = 0;
+        for (size_t i = 0; i < opts.n_items; ++i) {
+            futures.push_back(strand.Submit([&next, i]() {
+                test_assert(next++ == i, "strand out of order");
+                if (i % 2) {
+                    throw ValueException(Value(i, std::to_string(i)));
+                }
+                return Value(i, std::to_string(i));
+            }));
+        }
+        for (size_t i = 0; i < futures.size(); ++i) {
+            try {
+                test_assert(futures[i].get() == Value(i, std::to_string(i)), "invalid result");
+            } catch (const ValueException& e) {
+                test_assert(i % 2 && e.get_result() == Value(i, std::to_string(i)), "invalid exception");
+            }
+        }
+
+        // refused after Shutdown like a plain Submit, rather than run inline
+        pool.Shutdown();
+        std::atomic_bool ran{false};
+        bool thrown = false;
+        try {
+            strand.Submit([&ran]() {
+                ran = true;
+            });
+        } catch (const std::exception&) {
+            thrown = true;
+        }
+        test_assert(thrown && !ran, "strand task accepted after shutdown");
+        test_assert(strand.Idle(), "refused key still tracked");
+
+        {
+            // the runner of an idle key counts against the queue bound
+            ThreadPoolOptions options;
+            options.queue_capacity = 1;
+            options.overflow = OverflowPolicy::kReject;
+            ThreadPool bounded{1, options};
+            std::promise<void> gate;
+            std::shared_future<void> opened = gate.get_future().share();
+            std::atomic_bool busy{false};
+            auto blocker = bounded.Submit([&busy, opened]() {
+                busy = true;
+                opened.wait();
+            });
+            while (!busy) {
+                std::this_thread::yield();
+            }
+            auto queued = bounded.Submit([]() {});
+            KeyedExecutor<size_t> executor(bounded);
+            thrown = false;
+            try {
+                executor.Submit(0, []() {});
+            } catch (const TaskRejectedError&) {
+                thrown = true;
+            }
+            test_assert(thrown, "strand runner skipped the queue bound");
+            test_assert(executor.ActiveKeys() == 0, "refused key still tracked");
+            gate.set_value();
+            blocker.get();
+            queued.get();
+        }
+
+        std::cout << "OK" << std::endl;
+    }
+
+    void do_test_overflow(const TestPoolOpts& opts, SchedulingMode scheduling, const std::string& name) {
+        std::cout << "Testing bounded " << name << " ... " << std::endl;
+
+        auto this_thread = std::this_thread::get_id();
+        auto thread_id = []() {
+            return std::this_thread::get_id();
+        };
+        for (OverflowPolicy policy : {OverflowPolicy::kBlock, OverflowPolicy::kReject,
+                                      OverflowPolicy::kCallerRuns, OverflowPolicy::kDropOldest}) {
+            ThreadPoolOptions options;
+            options.scheduling = scheduling;
+            options.queue_capacity = 2;
+            options.overflow = policy;
+            ThreadPool pool{opts.n_workers, options};
+
+            // every worker busy until the gate opens, then two tasks fill the
+            // queue; one blocker at a time, so that they never hit the bound
+            std::promise<void> gate;
+            std::shared_future<void> opened = gate.get_future().share();
+            std::atomic_size_t busy{0};
+            std::vector<std::future<void>> blockers;
+            for (size_t i = 0; i < opts.n_workers; ++i) {
+                blockers.push_back(pool.Submit([&busy, opened]() {
+                    ++busy;
+                    opened.wait();
+                }));
+                while (busy <= i) {
+                    std::this_thread::yield();
+                }
+            }
+            auto first = pool.Submit(thread_id);
+            auto second = pool.Async(thread_id);
+
+            ThreadPoolOverflowStats stats;
+            switch (policy) {
+            case OverflowPolicy::kBlock: {
+                std::future<std::thread::id> third;
+                std::thread submitter([&pool, &third, &thread_id]() {
+                    third = pool.Submit(thread_id);
+                });
+                while (pool.OverflowStats().blocked == 0) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+                gate.set_value();
+                submitter.join();
+                test_assert(third.get() != this_thread, "task ran on its submitter");
+                stats = pool.OverflowStats();
+                test_assert(stats.blocked == 1, "invalid overflow stats");
+                break;
+            }
+            case OverflowPolicy::kReject: {
+                bool thrown = false;
+                try {
+                    pool.Submit(thread_id);
+                } catch (const TaskRejectedError&) {
+                    thrown = true;
+                }
+                test_assert(thrown, "expected exception");
+                thrown = false;
+                try {
+                    pool.SubmitBatch(std::vector<std::function<void()>>(1, []() {}));
+                } catch (const TaskRejectedError&) {
+                    thrown = true;
+                }
+                test_assert(thrown, "expected exception");
+                stats = pool.OverflowStats();
+                test_assert(stats.rejected == 2, "invalid overflow stats");
+                break;
+            }
+            case OverflowPolicy::kCallerRuns:
+                test_assert(pool.Submit(thread_id).get() == this_thread, "task did not run on its submitter");
+                pool.SubmitBatch(std::vector<std::function<void()>>(2, []() {})).get();
+                stats = pool.OverflowStats();
+                test_assert(stats.ran_inline == 3, "invalid overflow stats");
+                break;
+            case OverflowPolicy::kDropOldest: {
+                auto third = pool.Submit(thread_id);
+                auto fourth = pool.Submit(thread_id);
+                bool thrown = false;
+                try {
+                    first.get();
+                } catch (const std::future_error& e) {
+                    thrown = e.code() == std::future_errc::broken_promise;
+                }
+                test_assert(thrown, "expected broken promise");
+                thrown = false;
+                try {
+                    second.Get();
+                } catch (const std::future_error& e) {
+                    thrown = e.code() == std::future_errc::broken_promise;
+                }
+                test_assert(thrown, "expected broken promise");
+                gate.set_value();
+                test_assert(third.get() != this_thread && fourth.get() != this_thread, "task ran on its submitter");
+                stats = pool.OverflowStats();
+                test_assert(stats.dropped == 2, "invalid overflow stats");
+                break;
+            }
+            }
+            if (policy != OverflowPolicy::kBlock && policy != OverflowPolicy::kDropOldest) {
+                gate.set_value();
+            }
+            for (auto& blocker : blockers) {
+                blocker.get();
+            }
+            if (policy != OverflowPolicy::kDropOldest) {
+                test_assert(first.get() != this_thread && second.Get() != this_thread, "task ran on its submitter");
+            }
+        }
+
+        {
+            // a queue holding only a batch has nothing to drop
+            ThreadPoolOptions options;
+            options.scheduling = scheduling;
+            options.queue_capacity = 2;
+            options.overflow = OverflowPolicy::kDropOldest;
+            ThreadPool pool{opts.n_workers, options};
+
+            std::promise<void> gate;
+            std::shared_future<void> opened = gate.get_future().share();
+            std::atomic_size_t busy{0};
+            std::vector<std::future<void>> blockers;
+            for (size_t i = 0; i < opts.n_workers; ++i) {
+                blockers.push_back(pool.Submit([&busy, opened]() {
+                    ++busy;
+                    opened.wait();
+                }));
+                while (busy <= i) {
+                    std::this_thread::yield();
+                }
+            }
+            std::atomic_size_t ran{0};
+            auto batch = pool.SubmitBatch(std::vector<std::function<void()>>(2, [&ran]() {
+                ++ran;
+            }));
+            bool thrown = false;
+            try {
+                pool.Submit(thread_id);
+            } catch (const TaskRejectedError&) {
+                thrown = true;
+            }
+            test_assert(thrown, "expected exception");
+            ThreadPoolOverflowStats stats = pool.OverflowStats();
+            test_assert(stats.undroppable == 1 && stats.rejected == 1 && stats.dropped == 0, "invalid overflow stats");
+            gate.set_value();
+            batch.get();
+            for (auto& blocker : blockers) {
+                blocker.get();
+            }
+            test_assert(ran == 2, "batch not run");
+        }
+
+        std::cout << "OK" << std::endl;
+    }
+
+    void do_test_parking(const TestPoolOpts& opts, SchedulingMode scheduling, const std::string& name) {
+        std::cout << "Testing parking of " << name << " ... " << std::endl;
+
+        ThreadPoolOptions options;
+        options.scheduling = scheduling;
+        ThreadPool pool{opts.n_workers, options};
+        auto wait_parked = [&pool, &opts]() {
+            for (size_t i = 0; i < 1000 && pool.ScalingStats().parked < opts.n_workers; ++i) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            test_assert(pool.ScalingStats().parked == opts.n_workers, "idle workers did not park");
+        };
+
+        // a task for an all-parked pool wakes exactly one worker
+        wait_parked();
+        test_assert(pool.Submit([]() {
+            return 1;
+        }).get() == 1, "invalid result");
+        test_assert(pool.ScalingStats().wakeups == 1, "more than one worker woken");
+        wait_parked();
+
+        // a batch wakes one worker, which passes the wakeup on
+        std::atomic<size_t> ran{0};
+        std::vector<std::function<void()>> batch(opts.n_items, [&ran]() {
+            ran.fetch_add(1);
+        });
+        pool.SubmitBatch(std::move(batch)).get();
+        test_assert(ran.load() == opts.n_items, "batch did not run");
+        wait_parked();
+
+        // parking right away: every task is a fresh wakeup, none may be lost
+        options.spin_rounds = 0;
+        ThreadPool eager{opts.n_workers, options};
+        size_t rounds = std::min<size_t>(opts.n_items, 1000);
+        ran = 0;
+        for (size_t i = 0; i < rounds; ++i) {
+            test_assert(eager.Submit([i]() {
+                return i;
+            }).get() == i, "invalid result");
+        }
+        std::vector<std::future<void>> futures;
+        for (size_t i = 0; i < rounds; ++i) {
+            futures.push_back(eager.Submit([&eager, &ran]() {
+                eager.Submit([&ran]() {
+                    ran.fetch_add(1);
+                });
+            }));
+        }
+        for (auto& future : futures) {
+            future.get();
+        }
+        eager.Shutdown();
+        test_assert(ran.load() == rounds, "nested tasks lost");
+
+        std::cout << "OK" << std::endl;
+    }
+
+    void do_test_cancellation(const TestPoolOpts& opts, SchedulingMode scheduling, const std::string& name) {
+        std::cout << "Testing cancellation of " << name << " ... " << std::endl;
+
+        ThreadPoolOptions options;
+        options.scheduling = scheduling;
+        ThreadPool pool{opts.n_workers, options};
+
+        // every worker busy until the gate opens, so the tasks below wait in
+        // the queue when their token is cancelled
+        std::promise<void> gate;
+        std::shared_future<void> opened = gate.get_future().share();
+        std::atomic_size_t busy{0};
+        std::vector<std::future<void>> blockers;
+        for (size_t i = 0; i < opts.n_workers; ++i) {
+            blockers.push_back(pool.Submit([&busy, opened]() {
+                ++busy;
+                opened.wait();
+            }));
+        }
+        while (busy < opts.n_workers) {
+            std::this_thread::yield();
+        }
+        CancellationToken token;
+        CancellationToken kept;
+        std::atomic_size_t ran{0};
+        std::vector<std::future<size_t>> cancelled;
+        std::vector<std::future<size_t>> results;
+        for (size_t i = 0; i < opts.n_items; ++i) {
+            auto task = [&ran](size_t i) {
+                ++ran;
+                return i;
+            };
+            cancelled.push_back(pool.Submit(token, task, i));
+            results.push_back(pool.Submit(kept, task, i));
+        }
+        token.Cancel();
+        for (auto& future : cancelled) {
+            test_assert(future.wait_for(std::chrono::seconds(0)) == std::future_status::ready,
+                        "queued task not failed on cancel");
+        }
+        gate.set_value();
+        for (size_t i = 0; i < opts.n_items; ++i) {
+            bool thrown = false;
+            try {
+                cancelled[i].get();
+            } catch (const TaskCancelledError&) {
+                thrown = true;
+            }
+            test_assert(thrown, "cancelled task did not fail");
+            test_assert(results[i].get() == i, "invalid result");
+        }
+        test_assert(ran.load() == opts.n_items, "cancelled task ran");
+        test_assert(!kept.Cancelled(), "token cancelled by another");
+
+        // a running task polls its token
+        CancellationToken stop;
+        std::atomic_bool started{false};
+        auto polling = pool.Submit(stop, [&started, stop]() {
+            started = true;
+            while (true) {
+                stop.ThrowIfCancelled();
+                std::this_thread::yield();
+            }
+        });
+        while (!started) {
+            std::this_thread::yield();
+        }
+        stop.Cancel();
+        bool thrown = false;
+        try {
+            polling.get();
+        } catch (const TaskCancelledError&) {
+            thrown = true;
+        }
+        test_assert(thrown, "running task did not stop");
+
+        {
+            // a full bounded queue makes room by discarding cancelled tasks
+            ThreadPoolOptions options;
+            options.scheduling = scheduling;
+            options.queue_capacity = 2;
+            options.overflow = OverflowPolicy::kReject;
+            ThreadPool bounded{opts.n_workers, options};
+
+            std::promise<void> gate;
+            std::shared_future<void> opened = gate.get_future().share();
+            std::atomic_size_t busy{0};
+            std::vector<std::future<void>> blockers;
+            for (size_t i = 0; i < opts.n_workers; ++i) {
+                blockers.push_back(bounded.Submit([&busy, opened]() {
+                    ++busy;
+                    opened.wait();
+                }));
+                while (busy <= i) {
+                    std::this_thread::yield();
+                }
+            }
+            CancellationToken dropped;
+            std::vector<std::future<size_t>> queued;
+            for (size_t i = 0; i < 2; ++i) {
+                queued.push_back(bounded.Submit(dropped, [](size_t i) {
+                    return i;
+                }, i));
+            }
+            dropped.Cancel();
+            std::vector<std::future<size_t>> fitted;
+            for (size_t i = 0; i < 2; ++i) {
+                fitted.push_back(bounded.Submit([](size_t i) {
+                    return i;
+                }, i));
+            }
+            test_assert(bounded.OverflowStats().rejected == 0, "cancelled tasks kept their room");
+            gate.set_value();
+            for (size_t i = 0; i < 2; ++i) {
+                bool thrown = false;
+                try {
+                    queued[i].get();
+                } catch (const TaskCancelledError&) {
+                    thrown = true;
+                }
+                test_assert(thrown, "cancelled task did not fail");
+                test_assert(fitted[i].get() == i, "invalid result");
+            }
+            for (auto& blocker : blockers) {
+                blocker.get();
+            }
+        }
+
+        std::cout << "OK" << std::endl;
+    }
+
+    void do_test_task_graph(const TestPoolOpts& opts, SchedulingMode scheduling, const std::string& name) {
+        std::cout << "Testing task graph on " << name << " ... " << std::endl;
+
+        ThreadPoolOptions options;
+        options.scheduling = scheduling;
+        ThreadPool pool{opts.n_workers, options};
+
+        // every node depends on up to three random earlier ones and records
+        // when it ran
+        size_t n = std::min<size_t>(opts.n_items, 2000);
+        TaskGraph graph;
+        std::atomic_size_t clock{0};
+        std::vector<size_t> ran_at(n);
+        std::vector<std::vector<size_t>> dependencies(n);
+        uint64_t random = 42;
+        for (size_t i = 0; i < n; ++i) {
+            test_assert(graph.Add([&clock, &ran_at, i]() {
+                ran_at[i] = ++clock;
+            }) == i, "invalid node id");
+            for (size_t k = 0; i > 0 && k < 3; ++k) {
+                random = random * 6364136223846793005ull + 1442695040888963407ull;
+                size_t dependency = (random >> 33) % i;
+                graph.AddDependency(i, dependency);
+                dependencies[i].push_back(dependency);
+            }
+        }
+        test_assert(graph.Size() == n, "invalid graph size");
+
+        // a graph runs again and again
+        for (size_t run = 1; run <= 3; ++run) {
+            graph.Run(pool);
+            test_assert(clock.load() == run * n, "not every node ran");
+            for (size_t i = 0; i < n; ++i) {
+                const TaskGraphNodeTiming& timing = graph.Timing(i);
+                test_assert(timing.ran, "node timing missing");
+                for (size_t dependency : dependencies[i]) {
+                    test_assert(ran_at[dependency] < ran_at[i], "node ran before its dependency");
+                    const TaskGraphNodeTiming& before = graph.Timing(dependency);
+                    test_assert(before.start + before.duration <= timing.start, "node started before its dependency finished");
+                }
+            }
+        }
+
+        // run from a task of the same pool
+        pool.Submit([&graph, &pool]() {
+            graph.Run(pool);
+        }).get();
+        test_assert(clock.load() == 4 * n, "not every node ran");
+
+        // short runs in a row, each tearing its execution down right after
+        // the last node finishes
+        TaskGraph small;
+        std::atomic_size_t small_ran{0};
+        size_t head = small.Add([&small_ran]() {
+            ++small_ran;
+        });
+        for (size_t i = 0; i < 2; ++i) {
+            small.AddDependency(small.Add([&small_ran]() {
+                ++small_ran;
+            }), head);
+        }
+        for (size_t run = 1; run <= opts.n_items; ++run) {
+            small.Run(pool);
+            test_assert(small_ran.load() == 3 * run, "not every node ran");
+        }
+
+        // a failing node stops its dependents
+        TaskGraph failing;
+        std::atomic_size_t after{0};
+        size_t root = failing.Add([]() {
+            throw ValueException(Value(0, "0"));
+        });
+        for (size_t i = 0; i < opts.n_workers; ++i) {
+            failing.AddDependency(failing.Add([&after]() {
+                ++after;
+            }), root);
+        }
+        bool thrown = false;
+        try {
+            failing.Run(pool);
+        } catch (const ValueException&) {
+            thrown = true;
+        }
+        test_assert(thrown, "expected exception");
+        test_assert(after.load() == 0 && !failing.Timing(1).ran, "dependent of a failed node ran");
+
+        // a cycle is refused
+        TaskGraph cycle;
+        size_t a = cycle.Add([]() {});
+        size_t b = cycle.Add([]() {});
+        cycle.AddDependency(a, b);
+        cycle.AddDependency(b, a);
+        thrown = false;
+        try {
+            cycle.Run(pool);
+        } catch (const std::invalid_argument&) {
+            thrown = true;
+        }
+        test_assert(thrown, "cycle not detected");
+
+        std::cout << "OK" << std::endl;
+    }
+
+#if defined(__cpp_impl_coroutine)
+    Coro::Task<size_t> delayed_square(ThreadPool& pool, size_t i) {
+        co_await pool.ScheduleAfter(std::chrono::milliseconds(i % 10));
+        co_return i * i;
+    }
+
+    Coro::Task<size_t> sleepy(ThreadPool& pool, size_t i) {
+        co_await pool.ScheduleAfter(std::chrono::hours(1));
+        co_return i;
+    }
+
+    Coro::Task<size_t> sum_of_squares(ThreadPool& pool, size_t n) {
+        size_t sum = 0;
+        for (size_t i = 0; i < n; ++i) {
+            sum += co_await delayed_square(pool, i);
+        }
+        co_return sum;
+    }
+
+    Coro::Task<std::thread::id> resumed_on(ThreadPool& pool) {
+        co_await pool.Schedule();
+        co_return std::this_thread::get_id();
+    }
+
+    Coro::Task<void> failing(ThreadPool& pool) {
+        co_await pool.Schedule();
+        throw ValueException(Value());
+    }
+
+    void do_test_coroutines(const TestPoolOpts& opts) {
+        std::cout << "Testing coroutines ... " << std::endl;
+
+        ThreadPool pool{opts.n_workers};
+        test_assert(Coro::SyncWait(resumed_on(pool)) != std::this_thread::get_id(), "not resumed on a worker");
+
+        // far more sleeping coroutines than workers
+        std::vector<PoolFuture<size_t>> futures;
+        for (size_t i = 0; i < opts.n_items; ++i) {
+            futures.push_back(Coro::Spawn(pool, delayed_square(pool, i)));
+        }
+        std::vector<size_t> squares = WhenAll(std::move(futures)).Get();
+        for (size_t i = 0; i < opts.n_items; ++i) {
+            test_assert(squares[i] == i * i, "invalid result");
+        }
+
+        size_t n = std::min<size_t>(opts.n_items, 20);
+        test_assert(Coro::SyncWait(sum_of_squares(pool, n)) == (n - 1) * n * (2 * n - 1) / 6, "invalid result");
+
+        bool thrown = false;
+        try {
+            Coro::SyncWait(failing(pool));
+        } catch (const ValueException&) {
+            thrown = true;
+        }
+        test_assert(thrown, "expected exception");
+        thrown = false;
+        try {
+            Coro::Spawn(pool, failing(pool)).Get();
+        } catch (const ValueException&) {
+            thrown = true;
+        }
+        test_assert(thrown, "expected exception");
+
+        // a pool destroyed under sleeping coroutines resumes them with an
+        // error instead of leaving them hanging
+        std::vector<PoolFuture<size_t>> sleeping;
+        {
+            ThreadPool doomed{opts.n_workers};
+            for (size_t i = 0; i < opts.n_workers + 1; ++i) {
+                sleeping.push_back(Coro::Spawn(doomed, sleepy(doomed, i)));
+            }
+            for (size_t i = 0; i < 1000 && doomed.Metrics().queue_depth > 0; ++i) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+        for (auto& future : sleeping) {
+            thrown = false;
+            try {
+                future.Get();
+            } catch (const std::exception&) {
+                thrown = true;
+            }
+            test_assert(thrown, "sleeping coroutine not failed on shutdown");
+        }
+
+        std::cout << "OK" << std::endl;
+    }
+#endif
+
+    // sysfs-like cpu tree in a temp directory, removed on destruction
+    struct FakeCpuTree {
+        std::string root;
+        std::vector<std::string> dirs;
+        std::vector<std::string> files;
+
+        FakeCpuTree() {
+            char pattern[] = "/tmp/cpu_test_XXXXXX";
+            test_assert(mkdtemp(pattern) != nullptr, "could not create temp dir");
+            root = pattern;
+        }
+
+        ~FakeCpuTree() {
+            for (const auto& file : files) {
+                unlink(file.c_str());
+            }
+            for (auto dir = dirs.rbegin(); dir != dirs.rend(); ++dir) {
+                rmdir(dir->c_str());
+            }
+            rmdir(root.c_str());
+        }
+
+        void write(const std::string& path, const std::string& content) {
+            std::ofstream(root + "/" + path) << content << std::endl;
+            files.push_back(root + "/" + path);
+        }
+
+        void add_cpu(int id, int package, int core) {
+            std::string cpu = root + "/cpu" + std::to_string(id);
+            for (const auto& dir : {cpu, cpu + "/topology"}) {
+                mkdir(dir.c_str(), 0700);
+                dirs.push_back(dir);
+            }
+            write("cpu" + std::to_string(id) + "/topology/physical_package_id", std::to_string(package));
+            write("cpu" + std::to_string(id) + "/topology/core_id", std::to_string(core));
+        }
+    };
+
+    std::vector<int> cpus_of_current_thread() {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        test_assert(0 == sched_getaffinity(0, sizeof(cpu_set_t), &cpuset), "could not get affinity");
+        std::vector<int> cpus;
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &cpuset)) {
+                cpus.push_back(cpu);
+            }
+        }
+        return cpus;
+    }
+
+    void do_test_placement(const TestPoolOpts& opts) {
+        std::cout << "Testing worker placement ... " << std::endl;
+
+        {
+            // 2 packages x 2 cores x 2 SMT siblings, numbered like Linux does
+            FakeCpuTree tree;
+            tree.write("online", "0-7");
+            for (int id = 0; id < 8; ++id) {
+                tree.add_cpu(id, id / 2 % 2, id % 2);
+            }
+            CpuTopology topology = CpuTopology::Read(tree.root);
+            test_assert(topology.Cpus().size() == 8, "invalid topology");
+            test_assert(topology.Order(PlacementPolicy::kCompact) == std::vector<int>({0, 4, 1, 5, 2, 6, 3, 7}),
+                        "invalid compact order");
+            test_assert(topology.Order(PlacementPolicy::kScatter) == std::vector<int>({0, 2, 1, 3, 4, 6, 5, 7}),
+                        "invalid scatter order");
+            test_assert(topology.Order(PlacementPolicy::kNoSmt) == std::vector<int>({0, 2, 1, 3}),
+                        "invalid no-SMT order");
+            test_assert(CpuTopology::ParseCpuList("0-2,5,7-8") == std::vector<int>({0, 1, 2, 5, 7, 8}),
+                        "invalid cpu list");
+        }
+
+        // workers go where a topology of a single CPU this thread may run
+        // on says, however the policy orders it
+        int cpu = cpus_of_current_thread().front();
+        FakeCpuTree tree;
+        tree.write("online", std::to_string(cpu));
+        tree.add_cpu(cpu, 0, 0);
+        for (PlacementPolicy placement : {PlacementPolicy::kCompact, PlacementPolicy::kExplicit}) {
+            ThreadPoolOptions options;
+            options.placement = placement;
+            options.cpus = {cpu};
+            options.topology = CpuTopology::Read(tree.root);
+            ThreadPool pool{opts.n_workers, options};
+            std::vector<std::future<std::vector<int>>> futures;
+            for (size_t i = 0; i < 4 * opts.n_workers; ++i) {
+                futures.push_back(pool.Submit(cpus_of_current_thread));
+            }
+            for (auto& future : futures) {
+                test_assert(future.get() == std::vector<int>({cpu}), "worker not pinned");
+            }
+            test_assert(pool.ScalingStats().pin_failures == 0, "pin failure reported");
+        }
+
+        // the kernel refuses a CPU that does not exist; the workers run
+        // anyway and the failures are counted
+        FakeCpuTree missing;
+        int nowhere = CPU_SETSIZE - 1;
+        missing.write("online", std::to_string(nowhere));
+        missing.add_cpu(nowhere, 0, 0);
+        ThreadPoolOptions options;
+        options.placement = PlacementPolicy::kCompact;
+        options.topology = CpuTopology::Read(missing.root);
+        ThreadPool pool{opts.n_workers, options};
+        test_assert(pool.Submit([]() {
+            return 1;
+        }).get() == 1, "invalid result");
+        for (size_t i = 0; i < 1000 && pool.ScalingStats().pin_failures < opts.n_workers; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        test_assert(pool.ScalingStats().pin_failures == opts.n_workers, "pin failures not reported");
+
+        std::cout << "OK" << std::endl;
+    }
+
     void run_pool_tests(int argc, char* argv[]) {
         TestPoolOpts opts;
         read_opts(argc, argv, opts.n_workers, opts.n_items);
-        do_test_pool(opts);
+        do_test_task();
+        ThreadPoolOptions shared;
+        do_test_pool(opts, shared, "shared queue");
+        ThreadPoolOptions stealing;
+        stealing.scheduling = SchedulingMode::kWorkStealing;
+        do_test_pool(opts, stealing, "work stealing");
+        do_test_elastic(opts, SchedulingMode::kSharedQueue, "shared queue");
+        do_test_elastic(opts, SchedulingMode::kWorkStealing, "work stealing");
+        do_test_metrics(opts, SchedulingMode::kSharedQueue, "shared queue");
+        do_test_metrics(opts, SchedulingMode::kWorkStealing, "work stealing");
+        do_test_timers(opts);
+        do_test_algorithms(opts);
+        do_test_strands(opts);
+        do_test_overflow(opts, SchedulingMode::kSharedQueue, "shared queue");
+        do_test_overflow(opts, SchedulingMode::kWorkStealing, "work stealing");
+        do_test_parking(opts, SchedulingMode::kSharedQueue, "shared queue");
+        do_test_parking(opts, SchedulingMode::kWorkStealing, "work stealing");
+        do_test_cancellation(opts, SchedulingMode::kSharedQueue, "shared queue");
+        do_test_cancellation(opts, SchedulingMode::kWorkStealing, "work stealing");
+        do_test_task_graph(opts, SchedulingMode::kSharedQueue, "shared queue");
+        do_test_task_graph(opts, SchedulingMode::kWorkStealing, "work stealing");
+#if defined(__cpp_impl_coroutine)
+        do_test_coroutines(opts);
+#endif
+        do_test_placement(opts);
     }
 }
 
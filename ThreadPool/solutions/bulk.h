@@ -0,0 +1,168 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <future>
+#include <mutex>
+
+// How ParallelFor cuts [begin, end) into chunks
+enum class LoopSchedule {
+    kStatic,   // one equal chunk per participant, at least grain long
+    kDynamic,  // grain-sized chunks handed out on demand
+    kGuided,   // a share of what is left, shrinking down to grain
+};
+
+// Shared completion of a SubmitBatch: the future is fulfilled by whichever
+// task finishes last, with the first exception any of them threw.
+class BatchCompletion {
+public:
+    explicit BatchCompletion(size_t count)
+        : remaining_(count)
+    {
+        if (count == 0) {
+            promise_.set_value();
+        }
+    }
+
+    std::future<void> GetFuture() {
+        return promise_.get_future();
+    }
+
+    template <class F>
+    void Run(F& fn) {
+        try {
+            fn();
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mtx_);
+            if (!error_) {
+                error_ = std::current_exception();
+            }
+        }
+        if (remaining_.fetch_sub(1) == 1) {
+            std::lock_guard<std::mutex> lock(mtx_);
+            if (error_) {
+                promise_.set_exception(error_);
+            } else {
+                promise_.set_value();
+            }
+        }
+    }
+
+private:
+    std::atomic<size_t> remaining_;
+    std::mutex mtx_;
+    std::exception_ptr error_;
+    std::promise<void> promise_;
+};
+
+// One ParallelFor call. The caller and every helper task claim chunks from
+// a shared cursor until the range is exhausted, so the loop finishes even if
+// no helper ever gets a worker. fn is only touched while the caller still
+// waits for the claimed iterations, so it is held by pointer.
+template <class F>
+class ParallelLoop {
+public:
+    ParallelLoop(size_t begin, size_t end, size_t grain, size_t participants, LoopSchedule schedule, F& fn)
+        : end_(end)
+        , total_(end - begin)
+        , grain_(std::max<size_t>(grain, 1))
+        , participants_(participants)
+        , static_chunk_(std::max(grain_, (total_ + participants - 1) / participants))
+        , schedule_(schedule)
+        , fn_(&fn)
+        , next_(begin)
+        , finished_(0)
+        , failed_(false)
+    {}
+
+    // Helpers worth waking: one per chunk beyond the caller's own
+    size_t Helpers(size_t max_helpers) const {
+        size_t chunk = schedule_ == LoopSchedule::kStatic ? static_chunk_ : grain_;
+        size_t chunks = (total_ + chunk - 1) / chunk;
+        return std::min(max_helpers, chunks - 1);
+    }
+
+    void Run() {
+        size_t first;
+        size_t last;
+        while (Claim(first, last)) {
+            if (!failed_.load(std::memory_order_relaxed)) {
+                try {
+                    for (size_t i = first; i < last; ++i) {
+                        (*fn_)(i);
+                    }
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(mtx_);
+                    if (!error_) {
+                        error_ = std::current_exception();
+                    }
+                    failed_ = true;
+                }
+            }
+            Finish(last - first);
+        }
+    }
+
+    // Blocks until every iteration has run, then rethrows the first error
+    void Wait() {
+        std::unique_lock<std::mutex> lock(mtx_);
+        cond_.wait(lock, [this] {
+            return finished_.load() == total_;
+        });
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+    }
+
+private:
+    const size_t end_;
+    const size_t total_;
+    const size_t grain_;
+    const size_t participants_;
+    const size_t static_chunk_;
+    const LoopSchedule schedule_;
+    F* const fn_;
+    std::atomic<size_t> next_;
+    std::atomic<size_t> finished_;
+    std::atomic<bool> failed_;
+    std::mutex mtx_;
+    std::condition_variable cond_;
+    std::exception_ptr error_;
+
+    bool Claim(size_t& first, size_t& last) {
+        size_t current = next_.load();
+        for (;;) {
+            if (current >= end_) {
+                return false;
+            }
+            size_t count = ChunkSize(end_ - current);
+            if (next_.compare_exchange_weak(current, current + count)) {
+                first = current;
+                last = current + count;
+                return true;
+            }
+        }
+    }
+
+    size_t ChunkSize(size_t remaining) const {
+        switch (schedule_) {
+        case LoopSchedule::kStatic:
+            return std::min(remaining, static_chunk_);
+        case LoopSchedule::kDynamic:
+            return std::min(remaining, grain_);
+        case LoopSchedule::kGuided:
+            return std::min(remaining, std::max(grain_, remaining / participants_));
+        }
+        return remaining;
+    }
+
+    void Finish(size_t count) {
+        if (finished_.fetch_add(count) + count == total_) {
+            std::lock_guard<std::mutex> lock(mtx_);
+            cond_.notify_all();
+        }
+    }
+};
@@ -0,0 +1,185 @@
+#pragma once
+
+#include "task.h"
+
+#include <atomic>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+
+class TaskCancelledError : public std::runtime_error {
+public:
+    TaskCancelledError()
+        : std::runtime_error("task cancelled")
+    {}
+};
+
+// Cooperative cancellation flag. Copies share it, so the code that gave a
+// token to its tasks can cancel them all through its own copy. Cancel fails
+// the futures of the tasks still queued right away, on the calling thread.
+class CancellationToken {
+public:
+    CancellationToken()
+        : state_(std::make_shared<State>())
+    {}
+
+    void Cancel() {
+        std::unordered_map<size_t, Task> callbacks;
+        {
+            std::lock_guard<std::mutex> lock(state_->mtx);
+            state_->cancelled.store(true, std::memory_order_release);
+            callbacks.swap(state_->callbacks);
+        }
+        for (auto& callback : callbacks) {
+            callback.second();
+        }
+    }
+
+    bool Cancelled() const {
+        return state_->cancelled.load(std::memory_order_acquire);
+    }
+
+    // For a running task to bail out, failing its future the same way as a
+    // task cancelled before it started
+    void ThrowIfCancelled() const {
+        if (Cancelled()) {
+            throw TaskCancelledError();
+        }
+    }
+
+private:
+    friend class ThreadPool;
+    template <class Bound>
+    friend class CancellableTask;
+
+    struct State {
+        State()
+            : cancelled(false)
+            , next_id(1)
+        {}
+
+        std::mutex mtx;
+        std::atomic<bool> cancelled;  // set under mtx
+        std::unordered_map<size_t, Task> callbacks;  // under mtx
+        size_t next_id;  // under mtx
+    };
+
+    std::shared_ptr<State> state_;
+
+    // Keeps callback to run on Cancel. Returns the id to Unsubscribe it
+    // with, or 0 if the token is already cancelled and callback was dropped.
+    size_t Subscribe(Task&& callback) {
+        std::lock_guard<std::mutex> lock(state_->mtx);
+        if (state_->cancelled.load(std::memory_order_relaxed)) {
+            return 0;
+        }
+        size_t id = state_->next_id++;
+        state_->callbacks.emplace(id, std::move(callback));
+        return id;
+    }
+
+    void Unsubscribe(size_t id) {
+        if (id == 0) {
+            return;
+        }
+        Task callback;
+        {
+            std::lock_guard<std::mutex> lock(state_->mtx);
+            auto it = state_->callbacks.find(id);
+            if (it == state_->callbacks.end()) {
+                return;
+            }
+            callback = std::move(it->second);
+            state_->callbacks.erase(it);
+        }
+        // destroyed unlocked: it may hold the last reference to a task
+    }
+
+    // Stays valid while a copy of the token lives, for the pool to tell
+    // cancelled tasks in its queue apart
+    const std::atomic<bool>* Flag() const {
+        return &state_->cancelled;
+    }
+};
+
+// A PromiseTask that, once the token is cancelled, fails its promise with
+// TaskCancelledError instead of calling fn: at Cancel while it is queued,
+// or when it is taken off the queue. Dropped unrun, it fails the same way
+// if cancelled and with broken_promise otherwise.
+template <class Bound>
+class CancellableTask {
+public:
+    CancellableTask(const CancellationToken& token, Bound&& bound)
+        : token_(token)
+        , pending_(std::make_shared<Pending>(std::move(bound)))
+        , id_(0)
+    {
+        std::shared_ptr<Pending> pending = pending_;
+        id_ = token_.Subscribe([pending]() {
+            pending->Cancel();
+        });
+    }
+
+    CancellableTask(CancellableTask&& other) noexcept
+        : token_(std::move(other.token_))
+        , pending_(std::move(other.pending_))
+        , id_(other.id_)
+    {}
+
+    ~CancellableTask() {
+        if (pending_) {
+            token_.Unsubscribe(id_);
+            if (token_.Cancelled()) {
+                pending_->Cancel();
+            }
+        }
+    }
+
+    void operator()() {
+        if (token_.Cancelled()) {
+            pending_->Cancel();
+            return;
+        }
+        pending_->Run();
+    }
+
+private:
+    // Shared with the Cancel callback; whichever claims it first settles
+    // the promise
+    struct Pending {
+        explicit Pending(Bound&& bound)
+            : bound(std::move(bound))
+            , claimed(false)
+        {}
+
+        void Run() {
+            if (!claimed.exchange(true)) {
+                bound();
+            }
+        }
+
+        void Cancel() {
+            if (!claimed.exchange(true)) {
+                bound.Fail(std::make_exception_ptr(TaskCancelledError()));
+            }
+        }
+
+        Bound bound;
+        std::atomic<bool> claimed;
+    };
+
+    CancellationToken token_;
+    std::shared_ptr<Pending> pending_;
+    size_t id_;
+};
+
+template <class R, class F, class... Args>
+Task MakeCancellableTask(const CancellationToken& token, std::promise<R>&& promise, F&& fn, Args&&... args) {
+    using Bound = PromiseTask<R, typename std::decay<F>::type, typename std::decay<Args>::type...>;
+    return Task(CancellableTask<Bound>(token, Bound(std::move(promise), std::forward<F>(fn), std::forward<Args>(args)...)));
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+constexpr size_t kCacheLineSize = 64;
+
+// Chase-Lev work-stealing deque of pointers (Le et al., "Correct and
+// Efficient Work-Stealing for Weak Memory Models"). The owner pushes and
+// pops at the bottom, thieves steal from the top. The fences of the paper
+// are folded into seq_cst operations. Outgrown buffers are kept until
+// destruction, since a thief may still be reading from one.
+template <class T>
+class ChaseLevDeque {
+public:
+    explicit ChaseLevDeque(size_t capacity = 256)
+        : top_(0)
+        , bottom_(0)
+    {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        buffers_.emplace_back(new Buffer(size));
+        buffer_.store(buffers_.back().get(), std::memory_order_relaxed);
+    }
+
+    ChaseLevDeque(const ChaseLevDeque&) = delete;
+    ChaseLevDeque& operator=(const ChaseLevDeque&) = delete;
+
+    // Owner only
+    void Push(T* item) {
+        int64_t bottom = bottom_.value.load(std::memory_order_relaxed);
+        int64_t top = top_.value.load(std::memory_order_acquire);
+        Buffer* buffer = buffer_.load(std::memory_order_relaxed);
+        if (bottom - top > static_cast<int64_t>(buffer->mask)) {
+            buffer = Grow(buffer, top, bottom);
+        }
+        buffer->Put(bottom, item);
+        bottom_.value.store(bottom + 1, std::memory_order_seq_cst);
+    }
+
+    // Owner only. Returns nullptr when empty.
+    T* Pop() {
+        int64_t bottom = bottom_.value.load(std::memory_order_relaxed) - 1;
+        Buffer* buffer = buffer_.load(std::memory_order_relaxed);
+        bottom_.value.store(bottom, std::memory_order_seq_cst);
+        int64_t top = top_.value.load(std::memory_order_seq_cst);
+        if (top > bottom) {
+            bottom_.value.store(bottom + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        T* item = buffer->Get(bottom);
+        if (top == bottom) {
+            // the last item: race the thieves for it
+            if (!top_.value.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst)) {
+                item = nullptr;
+            }
+            bottom_.value.store(bottom + 1, std::memory_order_relaxed);
+        }
+        return item;
+    }
+
+    // Any thread. Returns nullptr when empty or when another thread won.
+    T* Steal() {
+        int64_t top = top_.value.load(std::memory_order_seq_cst);
+        int64_t bottom = bottom_.value.load(std::memory_order_seq_cst);
+        if (top >= bottom) {
+            return nullptr;
+        }
+        T* item = buffer_.load(std::memory_order_acquire)->Get(top);
+        if (!top_.value.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst)) {
+            return nullptr;
+        }
+        return item;
+    }
+
+    bool Empty() const {
+        return top_.value.load(std::memory_order_seq_cst) >= bottom_.value.load(std::memory_order_seq_cst);
+    }
+
+private:
+    struct Buffer {
+        const size_t mask;
+        std::unique_ptr<std::atomic<T*>[]> cells;
+
+        explicit Buffer(size_t size)
+            : mask(size - 1)
+            , cells(new std::atomic<T*>[size])
+        {}
+
+        T* Get(int64_t index) const {
+            return cells[index & mask].load(std::memory_order_relaxed);
+        }
+
+        void Put(int64_t index, T* item) {
+            cells[index & mask].store(item, std::memory_order_relaxed);
+        }
+    };
+
+    // Padded rather than alignas: c++14 new does not honour over-alignment
+    struct PaddedIndex {
+        std::atomic<int64_t> value;
+        char padding[kCacheLineSize];
+
+        explicit PaddedIndex(int64_t index)
+            : value(index)
+        {}
+    };
+
+    PaddedIndex top_;
+    PaddedIndex bottom_;
+    std::atomic<Buffer*> buffer_;
+    std::vector<std::unique_ptr<Buffer>> buffers_;
+
+    Buffer* Grow(Buffer* buffer, int64_t top, int64_t bottom) {
+        buffers_.emplace_back(new Buffer(2 * (buffer->mask + 1)));
+        Buffer* grown = buffers_.back().get();
+        for (int64_t i = top; i < bottom; ++i) {
+            grown->Put(i, buffer->Get(i));
+        }
+        buffer_.store(grown, std::memory_order_release);
+        return grown;
+    }
+};
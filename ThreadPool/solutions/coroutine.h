@@ -0,0 +1,257 @@
+#pragma once
+
+// Coroutines on ThreadPool. Only in the C++20 build (make build20); the
+// C++14 build sees an empty header.
+#if defined(__cpp_impl_coroutine)
+
+#include "solution.h"
+
+#include <condition_variable>
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+
+namespace Coro {
+
+template <class T>
+class Task;
+
+// Hands control back to whoever awaited the task once its body is done
+class PromiseBase {
+public:
+    struct FinalAwaiter {
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        template <class Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> done) noexcept {
+            return done.promise().continuation_;
+        }
+
+        void await_resume() const noexcept {
+        }
+    };
+
+    std::suspend_always initial_suspend() const noexcept {
+        return {};
+    }
+
+    FinalAwaiter final_suspend() const noexcept {
+        return {};
+    }
+
+    void unhandled_exception() {
+        error_ = std::current_exception();
+    }
+
+    void SetContinuation(std::coroutine_handle<> continuation) {
+        continuation_ = continuation;
+    }
+
+protected:
+    std::coroutine_handle<> continuation_ = std::noop_coroutine();
+    std::exception_ptr error_;
+};
+
+template <class T>
+class Promise : public PromiseBase {
+public:
+    Task<T> get_return_object();
+
+    template <class V>
+    void return_value(V&& value) {
+        value_.Set(std::forward<V>(value));
+    }
+
+    T Result() {
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+        return value_.Take();
+    }
+
+private:
+    ValueSlot<T> value_;
+};
+
+template <>
+class Promise<void> : public PromiseBase {
+public:
+    Task<void> get_return_object();
+
+    void return_void() {
+    }
+
+    void Result() {
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+    }
+};
+
+// Lazy coroutine returning T. Its body starts when the task is awaited, on
+// the awaiting thread, and co_await pool.Schedule() inside moves it onto a
+// worker. A suspended task holds no thread, only its frame.
+template <class T>
+class Task {
+public:
+    using promise_type = Promise<T>;
+
+    Task(Task&& other) noexcept
+        : handle_(std::exchange(other.handle_, nullptr))
+    {}
+
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            Destroy();
+            handle_ = std::exchange(other.handle_, nullptr);
+        }
+        return *this;
+    }
+
+    ~Task() {
+        Destroy();
+    }
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle_.promise().SetContinuation(awaiting);
+        return handle_;
+    }
+
+    T await_resume() {
+        return handle_.promise().Result();
+    }
+
+    // Awaits the task without taking its result
+    struct Completion {
+        std::coroutine_handle<promise_type> handle;
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+            handle.promise().SetContinuation(awaiting);
+            return handle;
+        }
+
+        void await_resume() const noexcept {
+        }
+    };
+
+    Completion Done() {
+        return Completion{handle_};
+    }
+
+private:
+    friend class Promise<T>;
+
+    std::coroutine_handle<promise_type> handle_;
+
+    explicit Task(std::coroutine_handle<promise_type> handle)
+        : handle_(handle)
+    {}
+
+    void Destroy() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+};
+
+template <class T>
+Task<T> Promise<T>::get_return_object() {
+    return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object() {
+    return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+// Coroutine that starts right away and frees its own frame when done
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() const noexcept {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() const noexcept {
+            return {};
+        }
+
+        std::suspend_never final_suspend() const noexcept {
+            return {};
+        }
+
+        void return_void() {
+        }
+
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+};
+
+template <class T>
+Detached Fulfil(ThreadPool& pool, Task<T> task, std::shared_ptr<FutureState<T>> state) {
+    co_await pool.Schedule();
+    ValueSlot<T> result;
+    try {
+        if constexpr (std::is_void<T>::value) {
+            co_await std::move(task);
+        } else {
+            result.Set(co_await std::move(task));
+        }
+    } catch (...) {
+        state->SetException(std::current_exception());
+        co_return;
+    }
+    if constexpr (std::is_void<T>::value) {
+        state->SetValue();
+    } else {
+        state->SetValue(result.Take());
+    }
+}
+
+// Starts task on a worker of pool; its result can then be chained with
+// Then, WhenAll and WhenAny like any other PoolFuture
+template <class T>
+PoolFuture<T> Spawn(ThreadPool& pool, Task<T> task) {
+    auto state = std::make_shared<FutureState<T>>();
+    Fulfil(pool, std::move(task), state);
+    return PoolFuture<T>(&pool, std::move(state));
+}
+
+// Runs task on the calling thread until it first suspends, then blocks
+// until it is done and returns its value or rethrows its error
+template <class T>
+T SyncWait(Task<T> task) {
+    struct Latch {
+        std::mutex mtx;
+        std::condition_variable cond;
+        bool done = false;
+    } latch;
+    [](Task<T>& task, Latch& latch) -> Detached {
+        co_await task.Done();
+        std::lock_guard<std::mutex> lock(latch.mtx);
+        latch.done = true;
+        latch.cond.notify_all();
+    }(task, latch);
+    std::unique_lock<std::mutex> lock(latch.mtx);
+    latch.cond.wait(lock, [&latch] {
+        return latch.done;
+    });
+    return task.await_resume();
+}
+
+}  // namespace Coro
+
+#endif
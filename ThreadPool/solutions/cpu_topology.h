@@ -0,0 +1,209 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+// Where ThreadPool pins its workers. Worker i goes to the i-th CPU of the
+// policy's order, wrapping around when there are more workers than CPUs.
+enum class PlacementPolicy {
+    kNone,      // leave it to the kernel
+    kCompact,   // fill a core's SMT siblings, then the next core, package by package
+    kScatter,   // one CPU per core, round-robin over packages, siblings only once every core has one
+    kNoSmt,     // only the first SMT sibling of every core, in scatter order
+    kExplicit,  // ThreadPoolOptions::cpus as given
+};
+
+struct LogicalCpu {
+    int id;
+    int package;
+    int core;
+};
+
+// Logical CPUs as described by sysfs (/sys/devices/system/cpu by default)
+class CpuTopology {
+public:
+    CpuTopology() = default;
+
+    explicit CpuTopology(std::vector<LogicalCpu> cpus)
+        : cpus_(std::move(cpus))
+    {}
+
+    static CpuTopology Read(const std::string& root = "/sys/devices/system/cpu") {
+        std::string online;
+        if (!ReadLine(root + "/online", online)) {
+            throw std::runtime_error("could not read " + root + "/online");
+        }
+        std::vector<LogicalCpu> cpus;
+        for (int id : ParseCpuList(online)) {
+            std::string topology = root + "/cpu" + std::to_string(id) + "/topology/";
+            LogicalCpu cpu{id, 0, id};
+            // without topology files every CPU counts as a core of its own
+            ReadInt(topology + "physical_package_id", cpu.package);
+            ReadInt(topology + "core_id", cpu.core);
+            cpus.push_back(cpu);
+        }
+        return CpuTopology(std::move(cpus));
+    }
+
+    // The machine's topology, less the CPUs this process may not run on
+    static CpuTopology Current() {
+        CpuTopology topology = Read();
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (0 != sched_getaffinity(0, sizeof(allowed), &allowed)) {
+            return topology;
+        }
+        std::vector<LogicalCpu> cpus;
+        for (const LogicalCpu& cpu : topology.cpus_) {
+            if (cpu.id < CPU_SETSIZE && CPU_ISSET(cpu.id, &allowed)) {
+                cpus.push_back(cpu);
+            }
+        }
+        return CpuTopology(std::move(cpus));
+    }
+
+    const std::vector<LogicalCpu>& Cpus() const {
+        return cpus_;
+    }
+
+    bool Contains(int id) const {
+        return std::any_of(cpus_.begin(), cpus_.end(), [id](const LogicalCpu& cpu) {
+            return cpu.id == id;
+        });
+    }
+
+    // CPU ids in the order the policy hands them to workers
+    std::vector<int> Order(PlacementPolicy policy, const std::vector<int>& explicit_cpus = std::vector<int>()) const {
+        switch (policy) {
+        case PlacementPolicy::kNone:
+            return std::vector<int>();
+        case PlacementPolicy::kCompact:
+            return CompactOrder();
+        case PlacementPolicy::kScatter:
+            return ScatterOrder(false);
+        case PlacementPolicy::kNoSmt:
+            return ScatterOrder(true);
+        case PlacementPolicy::kExplicit:
+            for (int id : explicit_cpus) {
+                if (!Contains(id)) {
+                    throw std::invalid_argument("cpu " + std::to_string(id) + " is not available");
+                }
+            }
+            return explicit_cpus;
+        }
+        return std::vector<int>();
+    }
+
+    // "0-3,8,10-11" -> 0 1 2 3 8 10 11
+    static std::vector<int> ParseCpuList(const std::string& list) {
+        std::vector<int> ids;
+        std::istringstream in(list);
+        std::string range;
+        while (std::getline(in, range, ',')) {
+            if (range.empty() || range == "\n") {
+                continue;
+            }
+            size_t dash = range.find('-');
+            int first = std::stoi(range.substr(0, dash));
+            int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            for (int id = first; id <= last; ++id) {
+                ids.push_back(id);
+            }
+        }
+        return ids;
+    }
+
+private:
+    std::vector<LogicalCpu> cpus_;
+
+    std::vector<int> CompactOrder() const {
+        std::vector<LogicalCpu> cpus = cpus_;
+        std::sort(cpus.begin(), cpus.end(), [](const LogicalCpu& lhs, const LogicalCpu& rhs) {
+            return std::tie(lhs.package, lhs.core, lhs.id) < std::tie(rhs.package, rhs.core, rhs.id);
+        });
+        std::vector<int> ids;
+        for (const LogicalCpu& cpu : cpus) {
+            ids.push_back(cpu.id);
+        }
+        return ids;
+    }
+
+    // Rank r takes the r-th sibling of every core, cores interleaved across
+    // packages, so siblings come last
+    std::vector<int> ScatterOrder(bool first_sibling_only) const {
+        std::map<int, std::map<int, std::vector<int>>> packages;
+        for (const LogicalCpu& cpu : cpus_) {
+            packages[cpu.package][cpu.core].push_back(cpu.id);
+        }
+        std::vector<std::vector<const std::vector<int>*>> cores_by_package;
+        for (auto& package : packages) {
+            cores_by_package.emplace_back();
+            for (auto& core : package.second) {
+                std::sort(core.second.begin(), core.second.end());
+                cores_by_package.back().push_back(&core.second);
+            }
+        }
+        std::vector<const std::vector<int>*> cores;
+        for (size_t k = 0; cores.size() < CountCores(cores_by_package); ++k) {
+            for (auto& package : cores_by_package) {
+                if (k < package.size()) {
+                    cores.push_back(package[k]);
+                }
+            }
+        }
+        std::vector<int> ids;
+        size_t ranks = first_sibling_only ? 1 : MaxSiblings(cores);
+        for (size_t rank = 0; rank < ranks; ++rank) {
+            for (const std::vector<int>* core : cores) {
+                if (rank < core->size()) {
+                    ids.push_back((*core)[rank]);
+                }
+            }
+        }
+        return ids;
+    }
+
+    static size_t CountCores(const std::vector<std::vector<const std::vector<int>*>>& cores_by_package) {
+        size_t count = 0;
+        for (auto& package : cores_by_package) {
+            count += package.size();
+        }
+        return count;
+    }
+
+    static size_t MaxSiblings(const std::vector<const std::vector<int>*>& cores) {
+        size_t siblings = 0;
+        for (const std::vector<int>* core : cores) {
+            siblings = std::max(siblings, core->size());
+        }
+        return siblings;
+    }
+
+    static bool ReadLine(const std::string& path, std::string& line) {
+        std::ifstream in(path);
+        return static_cast<bool>(std::getline(in, line));
+    }
+
+    static bool ReadInt(const std::string& path, int& value) {
+        std::ifstream in(path);
+        return static_cast<bool>(in >> value);
+    }
+};
+
+// Pins the calling thread to one CPU. Returns false if the kernel refused.
+inline bool PinCurrentThread(int cpu) {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    return 0 == pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+}
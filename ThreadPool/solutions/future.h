@@ -0,0 +1,416 @@
+#pragma once
+
+#include "task.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+class ThreadPool;
+
+// Storage for a single result value, empty for void
+template <class T>
+class ValueSlot {
+public:
+    ValueSlot()
+        : set_(false)
+    {}
+
+    ValueSlot(const ValueSlot&) = delete;
+    ValueSlot& operator=(const ValueSlot&) = delete;
+
+    ~ValueSlot() {
+        if (set_) {
+            Get()->~T();
+        }
+    }
+
+    template <class V>
+    void Set(V&& value) {
+        new (&storage_) T(std::forward<V>(value));
+        set_ = true;
+    }
+
+    T Take() {
+        return std::move(*Get());
+    }
+
+private:
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage_;
+    bool set_;
+
+    T* Get() {
+        return reinterpret_cast<T*>(&storage_);
+    }
+};
+
+template <>
+class ValueSlot<void> {
+public:
+    void Set() {
+    }
+
+    void Take() {
+    }
+};
+
+///////////////////////////////////////////////////////////////////////
+
+// Shared state behind a PoolFuture. Callbacks registered with OnReady run
+// exactly once, on the thread that completes the state, or right away if it
+// is already complete. The first value or error wins; later ones, like the
+// broken_promise of a task that is destroyed after it ran, are ignored.
+template <class T>
+class FutureState {
+public:
+    FutureState()
+        : ready_(false)
+    {}
+
+    FutureState(const FutureState&) = delete;
+    FutureState& operator=(const FutureState&) = delete;
+
+    template <class... V>
+    void SetValue(V&&... value) {
+        std::unique_lock<std::mutex> lock(mtx_);
+        if (ready_) {
+            return;
+        }
+        value_.Set(std::forward<V>(value)...);
+        Complete(lock);
+    }
+
+    void SetException(std::exception_ptr error) {
+        std::unique_lock<std::mutex> lock(mtx_);
+        if (ready_) {
+            return;
+        }
+        error_ = error;
+        Complete(lock);
+    }
+
+    void OnReady(Task&& callback) {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            if (!ready_) {
+                callbacks_.push_back(std::move(callback));
+                return;
+            }
+        }
+        callback();
+    }
+
+    bool Ready() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return ready_;
+    }
+
+    void Wait() {
+        std::unique_lock<std::mutex> lock(mtx_);
+        cond_.wait(lock, [this] {
+            return ready_;
+        });
+    }
+
+    // Only once ready: the error, if the producer failed
+    std::exception_ptr Error() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return error_;
+    }
+
+    // Only once ready: rethrows the error or moves the value out
+    T Take() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+        return value_.Take();
+    }
+
+private:
+    std::mutex mtx_;
+    std::condition_variable cond_;
+    bool ready_;
+    ValueSlot<T> value_;
+    std::exception_ptr error_;
+    std::vector<Task> callbacks_;
+
+    // Under mtx_, which it releases before running the callbacks
+    void Complete(std::unique_lock<std::mutex>& lock) {
+        std::vector<Task> callbacks;
+        ready_ = true;
+        callbacks.swap(callbacks_);
+        cond_.notify_all();
+        lock.unlock();
+        for (auto& callback : callbacks) {
+            callback();
+        }
+    }
+};
+
+// Completes state with fn(args...), or with whatever fn throws. What the
+// callbacks of state throw is theirs and passes through.
+template <class T, class F, class... Args>
+void FulfilWith(FutureState<T>& state, std::false_type, F& fn, Args&&... args) {
+    ValueSlot<T> result;
+    try {
+        result.Set(fn(std::forward<Args>(args)...));
+    } catch (...) {
+        state.SetException(std::current_exception());
+        return;
+    }
+    state.SetValue(result.Take());
+}
+
+template <class T, class F, class... Args>
+void FulfilWith(FutureState<T>& state, std::true_type, F& fn, Args&&... args) {
+    try {
+        fn(std::forward<Args>(args)...);
+    } catch (...) {
+        state.SetException(std::current_exception());
+        return;
+    }
+    state.SetValue();
+}
+
+template <class T, class F, class... Args>
+void FulfilWith(FutureState<T>& state, F& fn, Args&&... args) {
+    FulfilWith(state, std::is_void<T>(), fn, std::forward<Args>(args)...);
+}
+
+// ThreadPool::Async's counterpart of PromiseTask
+template <class R, class F, class... Args>
+class FutureTask {
+public:
+    template <class G, class... A>
+    FutureTask(std::shared_ptr<FutureState<R>> state, G&& fn, A&&... args)
+        : state_(std::move(state))
+        , fn_(std::forward<G>(fn))
+        , args_(std::forward<A>(args)...)
+    {}
+
+    FutureTask(FutureTask&&) = default;
+
+    // Dropped without running, like a destroyed std::packaged_task
+    ~FutureTask() {
+        if (state_) {
+            state_->SetException(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+        }
+    }
+
+    void operator()() {
+        Call(std::index_sequence_for<Args...>());
+        state_.reset();
+    }
+
+private:
+    std::shared_ptr<FutureState<R>> state_;
+    F fn_;
+    std::tuple<Args...> args_;
+
+    template <size_t... I>
+    void Call(std::index_sequence<I...>) {
+        FulfilWith(*state_, fn_, std::get<I>(std::move(args_))...);
+    }
+};
+
+///////////////////////////////////////////////////////////////////////
+
+template <class T>
+class PoolFuture;
+
+// What Then(fn) resolves to: fn called with the value, or with nothing
+template <class T, class F>
+struct ThenResultOf {
+    using type = CallResult<typename std::decay<F>::type, T>;
+};
+
+template <class F>
+struct ThenResultOf<void, F> {
+    using type = CallResult<typename std::decay<F>::type>;
+};
+
+template <class T, class F>
+using ThenResult = typename ThenResultOf<T, F>::type;
+
+// Lets the combinators reach into futures without widening their API
+struct FutureAccess {
+    template <class T>
+    static std::shared_ptr<FutureState<T>> Release(PoolFuture<T>& future) {
+        if (!future.state_) {
+            throw std::logic_error("no state");
+        }
+        return std::move(future.state_);
+    }
+
+    template <class T>
+    static ThreadPool* Pool(const PoolFuture<T>& future) {
+        return future.pool_;
+    }
+};
+
+// Move-only result of ThreadPool::Async. Unlike std::future it can chain
+// work with Then instead of parking a thread in Get. A future whose value
+// has been taken by Get, Then or a combinator is no longer valid.
+template <class T>
+class PoolFuture {
+public:
+    PoolFuture()
+        : pool_(nullptr)
+    {}
+
+    PoolFuture(ThreadPool* pool, std::shared_ptr<FutureState<T>> state)
+        : pool_(pool)
+        , state_(std::move(state))
+    {}
+
+    bool Valid() const {
+        return state_ != nullptr;
+    }
+
+    bool Ready() const {
+        return state_->Ready();
+    }
+
+    void Wait() const {
+        state_->Wait();
+    }
+
+    // Blocks until ready, then returns the value or rethrows the error
+    T Get() {
+        std::shared_ptr<FutureState<T>> state = FutureAccess::Release(*this);
+        state->Wait();
+        return state->Take();
+    }
+
+    // Runs fn on the pool once the value is ready and returns its future.
+    // If this future fails, fn is skipped and the error propagates.
+    template <class F>
+    PoolFuture<ThenResult<T, F>> Then(F&& fn);
+
+private:
+    friend struct FutureAccess;
+
+    ThreadPool* pool_;
+    std::shared_ptr<FutureState<T>> state_;
+};
+
+///////////////////////////////////////////////////////////////////////
+
+template <class T>
+struct AllOf {
+    using type = std::vector<T>;
+
+    static void Fulfil(FutureState<type>& all, std::vector<std::shared_ptr<FutureState<T>>>& states) {
+        type values;
+        values.reserve(states.size());
+        for (auto& state : states) {
+            values.push_back(state->Take());
+        }
+        all.SetValue(std::move(values));
+    }
+};
+
+template <>
+struct AllOf<void> {
+    using type = void;
+
+    static void Fulfil(FutureState<type>& all, std::vector<std::shared_ptr<FutureState<void>>>&) {
+        all.SetValue();
+    }
+};
+
+template <class T>
+struct AnyOf {
+    using type = std::pair<size_t, T>;
+
+    static void Fulfil(FutureState<type>& any, size_t index, FutureState<T>& state) {
+        any.SetValue(type(index, state.Take()));
+    }
+};
+
+template <>
+struct AnyOf<void> {
+    using type = size_t;
+
+    static void Fulfil(FutureState<type>& any, size_t index, FutureState<void>&) {
+        any.SetValue(index);
+    }
+};
+
+// Ready once every future is: all the values in order (nothing for void),
+// or the error of the first future in order that failed.
+template <class T>
+PoolFuture<typename AllOf<T>::type> WhenAll(std::vector<PoolFuture<T>> futures) {
+    using Result = typename AllOf<T>::type;
+
+    struct Join {
+        std::vector<std::shared_ptr<FutureState<T>>> states;
+        std::atomic<size_t> remaining;
+    };
+
+    auto all = std::make_shared<FutureState<Result>>();
+    ThreadPool* pool = futures.empty() ? nullptr : FutureAccess::Pool(futures.front());
+    auto join = std::make_shared<Join>();
+    join->remaining = futures.size();
+    for (auto& future : futures) {
+        join->states.push_back(FutureAccess::Release(future));
+    }
+    if (futures.empty()) {
+        AllOf<T>::Fulfil(*all, join->states);
+    }
+    for (auto& state : join->states) {
+        state->OnReady([join, all]() {
+            if (join->remaining.fetch_sub(1) != 1) {
+                return;
+            }
+            for (auto& state : join->states) {
+                if (std::exception_ptr error = state->Error()) {
+                    all->SetException(error);
+                    return;
+                }
+            }
+            AllOf<T>::Fulfil(*all, join->states);
+        });
+    }
+    return PoolFuture<Result>(pool, all);
+}
+
+// Ready as soon as the first future is: its index and value (just the index
+// for void), or its error.
+template <class T>
+PoolFuture<typename AnyOf<T>::type> WhenAny(std::vector<PoolFuture<T>> futures) {
+    using Result = typename AnyOf<T>::type;
+
+    if (futures.empty()) {
+        throw std::invalid_argument("WhenAny of no futures");
+    }
+    auto any = std::make_shared<FutureState<Result>>();
+    auto won = std::make_shared<std::atomic<bool>>(false);
+    ThreadPool* pool = FutureAccess::Pool(futures.front());
+    for (size_t i = 0; i < futures.size(); ++i) {
+        std::shared_ptr<FutureState<T>> state = FutureAccess::Release(futures[i]);
+        FutureState<T>* raw = state.get();
+        raw->OnReady([i, state, any, won]() {
+            if (won->exchange(true)) {
+                return;
+            }
+            if (std::exception_ptr error = state->Error()) {
+                any->SetException(error);
+            } else {
+                AnyOf<T>::Fulfil(*any, i, *state);
+            }
+        });
+    }
+    return PoolFuture<Result>(pool, any);
+}
@@ -0,0 +1,196 @@
+#pragma once
+
+#include "solution.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <numeric>
+#include <utility>
+#include <vector>
+
+// Parallel counterparts of the standard algorithms over random access
+// ranges. The range is cut into chunks that are handed out to the pool's
+// workers and the calling thread; a range of a single chunk runs inline.
+// Chunk boundaries depend only on the length of the range, the element type
+// and grain, so reductions and scans combine elements the same way whatever
+// the size of the pool: with an associative operation the result is the
+// same on every run, floating point included.
+namespace Parallel {
+
+// Bytes of input per chunk unless the caller picks a grain: a chunk stays in
+// a core's L2 while a task works through it, and is large enough to pay for
+// the task
+constexpr size_t kChunkBytes = 64 * 1024;
+
+// Elements per chunk: grain, or kChunkBytes worth, rounded up to whole cache
+// lines so that neighbouring chunks never write to the same line
+template <class T>
+size_t ChunkSize(size_t grain) {
+    size_t per_line = std::max<size_t>(1, kCacheLineSize / sizeof(T));
+    size_t chunk = grain ? grain : std::max<size_t>(1, kChunkBytes / sizeof(T));
+    return (chunk + per_line - 1) / per_line * per_line;
+}
+
+// Calls fn(index, first, last) for every chunk [first, last) of [0, n)
+template <class F>
+void ForEachChunk(ThreadPool& pool, size_t n, size_t chunk, F&& fn) {
+    size_t chunks = (n + chunk - 1) / chunk;
+    auto run = [&](size_t index) {
+        fn(index, index * chunk, std::min(n, (index + 1) * chunk));
+    };
+    if (chunks <= 1) {
+        if (n) {
+            run(0);
+        }
+        return;
+    }
+    pool.ParallelFor(0, chunks, 1, run, LoopSchedule::kDynamic);
+}
+
+template <class It, class F>
+void ForEach(ThreadPool& pool, It first, It last, F fn, size_t grain = 0) {
+    using T = typename std::iterator_traits<It>::value_type;
+    ForEachChunk(pool, last - first, ChunkSize<T>(grain), [&](size_t, size_t begin, size_t end) {
+        std::for_each(first + begin, first + end, fn);
+    });
+}
+
+// reduce(init, transform(x)) over the range, chunk by chunk from left to right
+template <class It, class T, class Reduce, class Transform>
+T TransformReduce(ThreadPool& pool, It first, It last, T init, Reduce reduce, Transform transform,
+                  size_t grain = 0) {
+    size_t n = last - first;
+    size_t chunk = ChunkSize<typename std::iterator_traits<It>::value_type>(grain);
+    std::vector<ValueSlot<T>> partials((n + chunk - 1) / chunk);
+    ForEachChunk(pool, n, chunk, [&](size_t index, size_t begin, size_t end) {
+        It it = first + begin;
+        T partial = transform(*it);
+        for (++it; it != first + end; ++it) {
+            partial = reduce(std::move(partial), transform(*it));
+        }
+        partials[index].Set(std::move(partial));
+    });
+    for (auto& partial : partials) {
+        init = reduce(std::move(init), partial.Take());
+    }
+    return init;
+}
+
+template <class It, class T, class Op = std::plus<>>
+T Reduce(ThreadPool& pool, It first, It last, T init, Op op = Op(), size_t grain = 0) {
+    return TransformReduce(pool, first, last, std::move(init), op, [](const auto& value) -> const auto& {
+        return value;
+    }, grain);
+}
+
+// Like std::partial_sum; out may be first. Every chunk but the last is
+// summed up first, then rescanned starting from the sum of the ones before.
+template <class It, class Out, class Op = std::plus<>>
+Out InclusiveScan(ThreadPool& pool, It first, It last, Out out, Op op = Op(), size_t grain = 0) {
+    using T = typename std::iterator_traits<It>::value_type;
+    size_t n = last - first;
+    size_t chunk = ChunkSize<T>(grain);
+    size_t chunks = (n + chunk - 1) / chunk;
+    if (chunks <= 1) {
+        return std::partial_sum(first, last, out, op);
+    }
+    std::vector<ValueSlot<T>> sums(chunks);
+    ForEachChunk(pool, (chunks - 1) * chunk, chunk, [&](size_t index, size_t begin, size_t end) {
+        T sum = first[begin];
+        for (size_t i = begin + 1; i < end; ++i) {
+            sum = op(std::move(sum), first[i]);
+        }
+        sums[index].Set(std::move(sum));
+    });
+    // carries[i] sums up chunks [0, i]
+    std::vector<T> carries;
+    carries.reserve(chunks - 1);
+    for (size_t index = 0; index + 1 < chunks; ++index) {
+        carries.push_back(index ? op(carries.back(), sums[index].Take()) : sums[index].Take());
+    }
+    ForEachChunk(pool, n, chunk, [&](size_t index, size_t begin, size_t end) {
+        if (index == 0) {
+            std::partial_sum(first, first + end, out, op);
+            return;
+        }
+        T sum = carries[index - 1];
+        for (size_t i = begin; i < end; ++i) {
+            sum = op(std::move(sum), first[i]);
+            out[i] = sum;
+        }
+    });
+    return out + n;
+}
+
+// How many elements of a come first among the first k a stable merge of a
+// and b puts out
+template <class It, class Compare>
+size_t CoRank(size_t k, It a, size_t a_size, It b, size_t b_size, Compare& comp) {
+    size_t low = k > b_size ? k - b_size : 0;
+    size_t high = std::min(k, a_size);
+    while (low < high) {
+        size_t i = low + (high - low) / 2;
+        // b[k - i - 1] only goes before a[i] if it is strictly less
+        if (comp(b[k - i - 1], a[i])) {
+            high = i;
+        } else {
+            low = i + 1;
+        }
+    }
+    return low;
+}
+
+// Merges neighbouring sorted runs of width elements from from into to. Every
+// chunk of the output is a task of its own that finds its inputs by
+// CoRank, so even the last round, a single merge, runs in parallel.
+template <class It, class Out, class Compare>
+void MergeRound(ThreadPool& pool, It from, Out to, size_t n, size_t width, size_t chunk, Compare& comp) {
+    ForEachChunk(pool, n, chunk, [&](size_t, size_t begin, size_t end) {
+        size_t pair = begin / (2 * width) * (2 * width);
+        size_t middle = std::min(n, pair + width);
+        size_t a_size = middle - pair;
+        size_t b_size = std::min(n, pair + 2 * width) - middle;
+        size_t a_begin = CoRank(begin - pair, from + pair, a_size, from + middle, b_size, comp);
+        size_t a_end = CoRank(end - pair, from + pair, a_size, from + middle, b_size, comp);
+        std::merge(std::make_move_iterator(from + pair + a_begin),
+                   std::make_move_iterator(from + pair + a_end),
+                   std::make_move_iterator(from + middle + (begin - pair - a_begin)),
+                   std::make_move_iterator(from + middle + (end - pair - a_end)),
+                   to + begin, comp);
+    });
+}
+
+// Like std::sort: chunks are sorted in place, then merged pairwise through a
+// buffer of default-constructed elements. Not stable.
+template <class It, class Compare = std::less<>>
+void Sort(ThreadPool& pool, It first, It last, Compare comp = Compare(), size_t grain = 0) {
+    using T = typename std::iterator_traits<It>::value_type;
+    size_t n = last - first;
+    size_t chunk = ChunkSize<T>(grain);
+    if (n <= chunk) {
+        std::sort(first, last, comp);
+        return;
+    }
+    ForEachChunk(pool, n, chunk, [&](size_t, size_t begin, size_t end) {
+        std::sort(first + begin, first + end, comp);
+    });
+    std::vector<T> buffer(n);
+    bool in_buffer = false;
+    for (size_t width = chunk; width < n; width *= 2) {
+        if (in_buffer) {
+            MergeRound(pool, buffer.begin(), first, n, width, chunk, comp);
+        } else {
+            MergeRound(pool, first, buffer.begin(), n, width, chunk, comp);
+        }
+        in_buffer = !in_buffer;
+    }
+    if (in_buffer) {
+        ForEachChunk(pool, n, chunk, [&](size_t, size_t begin, size_t end) {
+            std::move(buffer.begin() + begin, buffer.begin() + end, first + begin);
+        });
+    }
+}
+
+}  // namespace Parallel
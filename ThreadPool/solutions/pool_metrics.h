@@ -0,0 +1,178 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <vector>
+
+// Latencies are bucketed by powers of two of nanoseconds: bucket b holds
+// [2^b, 2^(b+1)) ns and the last one takes everything above.
+constexpr size_t kLatencyBuckets = 40;
+
+struct LatencyHistogram {
+    std::array<size_t, kLatencyBuckets> buckets{};
+    size_t count = 0;
+    std::chrono::nanoseconds total{0};
+    std::chrono::nanoseconds max{0};
+
+    std::chrono::nanoseconds Mean() const {
+        return count ? total / static_cast<std::chrono::nanoseconds::rep>(count) : std::chrono::nanoseconds(0);
+    }
+
+    // Upper bound of the bucket holding the q-quantile, q in [0, 1]
+    std::chrono::nanoseconds Quantile(double q) const {
+        if (count == 0) {
+            return std::chrono::nanoseconds(0);
+        }
+        size_t rank = static_cast<size_t>(q * count);
+        size_t seen = 0;
+        for (size_t bucket = 0; bucket < kLatencyBuckets; ++bucket) {
+            seen += buckets[bucket];
+            if (seen > rank || seen == count) {
+                return std::min(max, std::chrono::nanoseconds((2ull << bucket) - 1));
+            }
+        }
+        return max;
+    }
+};
+
+struct WorkerMetrics {
+    size_t tasks = 0;
+    size_t steals = 0;
+    std::chrono::nanoseconds busy{0};
+    std::chrono::nanoseconds idle{0};
+
+    double BusyRatio() const {
+        auto alive = busy + idle;
+        return alive.count() ? static_cast<double>(busy.count()) / alive.count() : 0.0;
+    }
+};
+
+struct ThreadPoolMetrics {
+    bool enabled = false;
+    size_t queue_depth = 0;
+    size_t completed = 0;
+    LatencyHistogram queue_wait;
+    LatencyHistogram run_time;
+    // one per worker slot; elastic slots add up all the workers they held
+    std::vector<WorkerMetrics> workers;
+    size_t steals = 0;
+    size_t failed_steal_scans = 0;
+    size_t lock_contentions = 0;
+    size_t task_nodes = 0;  // deque nodes workers have allocated, with work stealing
+};
+
+///////////////////////////////////////////////////////////////////////
+
+// Counters a single worker writes and anybody may read
+class WorkerCounters {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    WorkerCounters()
+        : tasks_(0)
+        , steals_(0)
+        , failed_steal_scans_(0)
+        , busy_nanos_(0)
+        , alive_nanos_(0)
+        , started_nanos_(0)
+        , running_(false)
+    {}
+
+    void OnStart() {
+        started_nanos_.store(Now(), std::memory_order_relaxed);
+        running_.store(true, std::memory_order_release);
+    }
+
+    void OnStop() {
+        running_.store(false, std::memory_order_relaxed);
+        Add(alive_nanos_, Now() - started_nanos_.load(std::memory_order_relaxed));
+    }
+
+    void OnTask(std::chrono::nanoseconds waited, std::chrono::nanoseconds ran) {
+        Add(tasks_, 1);
+        Add(busy_nanos_, ran.count());
+        Record(queue_wait_, waited);
+        Record(run_time_, ran);
+    }
+
+    void OnSteal(bool stolen) {
+        Add(stolen ? steals_ : failed_steal_scans_, 1);
+    }
+
+    void AddTo(ThreadPoolMetrics& metrics) const {
+        WorkerMetrics worker;
+        worker.tasks = Load(tasks_);
+        worker.steals = Load(steals_);
+        worker.busy = std::chrono::nanoseconds(Load(busy_nanos_));
+        size_t alive = Load(alive_nanos_);
+        if (running_.load(std::memory_order_acquire)) {
+            alive += Now() - Load(started_nanos_);
+        }
+        worker.idle = std::chrono::nanoseconds(alive > Load(busy_nanos_) ? alive - Load(busy_nanos_) : 0);
+        metrics.workers.push_back(worker);
+        metrics.completed += worker.tasks;
+        metrics.steals += worker.steals;
+        metrics.failed_steal_scans += Load(failed_steal_scans_);
+        Merge(queue_wait_, metrics.queue_wait);
+        Merge(run_time_, metrics.run_time);
+    }
+
+private:
+    struct Histogram {
+        std::array<std::atomic<size_t>, kLatencyBuckets> buckets{};
+        std::atomic<size_t> total_nanos{0};
+        std::atomic<size_t> max_nanos{0};
+    };
+
+    std::atomic<size_t> tasks_;
+    std::atomic<size_t> steals_;
+    std::atomic<size_t> failed_steal_scans_;
+    std::atomic<size_t> busy_nanos_;
+    std::atomic<size_t> alive_nanos_;
+    std::atomic<size_t> started_nanos_;
+    std::atomic<bool> running_;
+    Histogram queue_wait_;
+    Histogram run_time_;
+
+    static size_t Now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+    }
+
+    static size_t Bucket(size_t nanos) {
+        size_t bucket = 0;
+        for (; nanos > 1 && bucket + 1 < kLatencyBuckets; nanos >>= 1) {
+            ++bucket;
+        }
+        return bucket;
+    }
+
+    static void Record(Histogram& histogram, std::chrono::nanoseconds latency) {
+        size_t nanos = std::max<std::chrono::nanoseconds::rep>(latency.count(), 0);
+        Add(histogram.buckets[Bucket(nanos)], 1);
+        Add(histogram.total_nanos, nanos);
+        if (nanos > Load(histogram.max_nanos)) {
+            histogram.max_nanos.store(nanos, std::memory_order_relaxed);
+        }
+    }
+
+    static void Merge(const Histogram& from, LatencyHistogram& to) {
+        for (size_t bucket = 0; bucket < kLatencyBuckets; ++bucket) {
+            size_t count = Load(from.buckets[bucket]);
+            to.buckets[bucket] += count;
+            to.count += count;
+        }
+        to.total += std::chrono::nanoseconds(Load(from.total_nanos));
+        to.max = std::max(to.max, std::chrono::nanoseconds(Load(from.max_nanos)));
+    }
+
+    static void Add(std::atomic<size_t>& counter, size_t value) {
+        counter.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    static size_t Load(const std::atomic<size_t>& counter) {
+        return counter.load(std::memory_order_relaxed);
+    }
+};
@@ -1,52 +1,383 @@
 #pragma once
 
+#include "bulk.h"
+#include "cancellation.h"
+#include "chase_lev_deque.h"
+#include "cpu_topology.h"
+#include "future.h"
+#include "pool_metrics.h"
+#include "task.h"
+#include "timing_wheel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <vector>
 #include <deque>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 #include <future>
-#include <functional>
+#include <memory>
 #include <stdexcept>
+#include <type_traits>
 
-template <class T>
+enum class SchedulingMode {
+    kSharedQueue,   // every worker pops from task_queue_
+    kWorkStealing,  // per-worker Chase-Lev deques, task_queue_ only injects
+};
+
+// What Submit does when the queue is at ThreadPoolOptions::queue_capacity
+enum class OverflowPolicy {
+    kBlock,       // wait for room; a worker of the pool runs the task inline instead
+    kReject,      // throw TaskRejectedError
+    kCallerRuns,  // run the task inline on the submitting thread
+    kDropOldest,  // drop the oldest queued Submit or Async task, failing its future with broken_promise,
+                  // or reject as kReject if dropping them all would not make room
+};
+
+class TaskRejectedError : public std::runtime_error {
+public:
+    TaskRejectedError()
+        : std::runtime_error("thread pool queue is full")
+    {}
+};
+
+struct ThreadPoolOptions {
+    SchedulingMode scheduling = SchedulingMode::kSharedQueue;
+
+    // Elastic sizing: with max_workers above the initial count the pool
+    // grows while no worker is idle and the injected backlog is at least
+    // grow_queue_depth tasks deep or its oldest task has waited
+    // grow_queue_age. Workers beyond the initial count retire after
+    // idle_timeout without work. The age is checked on every submission
+    // and dequeue, and from the timer thread while a backlog waits, so a
+    // backlog behind workers all stuck in long tasks still grows the pool.
+    size_t max_workers = 0;
+    size_t grow_queue_depth = 16;
+    std::chrono::microseconds grow_queue_age{1000};
+    std::chrono::milliseconds idle_timeout{1000};
+
+    // Times an idle worker yields, watching for new work, before it parks.
+    // Submitters leave the waking to a worker that is still spinning.
+    size_t spin_rounds = 32;
+
+    // Worker pinning, over the CPUs this process may use. Worker slots keep
+    // their CPU when an elastic pool reuses them. A worker the kernel will
+    // not pin runs unpinned and counts in ScalingStats().pin_failures.
+    PlacementPolicy placement = PlacementPolicy::kNone;
+    std::vector<int> cpus;  // for PlacementPolicy::kExplicit
+    // CPUs to place workers on instead of the machine's, taken as they are
+    CpuTopology topology;
+
+    // Per-task timing and per-worker counters for Metrics(). Costs two
+    // clock reads per task.
+    bool collect_metrics = false;
+
+    // Bound on the tasks waiting in the shared queue, 0 for none. It holds
+    // for Submit, Async and SubmitBatch from outside the pool, and for the
+    // runner a strand queues when a task arrives for an idle key; tasks the
+    // pool queues for itself (continuations, task groups, loop helpers,
+    // timers) and, with work stealing, tasks workers submit to their own
+    // deques are never held back. A batch counts as a whole; neither it nor
+    // a strand runner is ever dropped. Since only Submit and Async tasks can be dropped, a queue
+    // filled with the others makes kDropOldest reject instead; such
+    // submissions count in OverflowStats().undroppable as well as rejected.
+    size_t queue_capacity = 0;
+    OverflowPolicy overflow = OverflowPolicy::kBlock;
+};
+
+struct ThreadPoolOverflowStats {
+    size_t blocked = 0;     // submissions that waited for room
+    size_t rejected = 0;
+    size_t ran_inline = 0;  // tasks run by their submitter
+    size_t dropped = 0;
+    size_t undroppable = 0;  // of rejected, kDropOldest ones with too little to drop
+};
+
+struct ThreadPoolScalingStats {
+    size_t live_workers = 0;
+    size_t peak_workers = 0;
+    size_t grown_for_depth = 0;
+    size_t grown_for_age = 0;
+    size_t retired = 0;
+    size_t parked = 0;        // workers parked right now
+    size_t wakeups = 0;       // parked workers woken for new work
+    size_t pin_failures = 0;  // workers left unpinned
+};
+
+// Untyped pool: Submit deduces the future type from the callable
 class ThreadPool {
 public:
-    ThreadPool(size_t num_threads = DefaultNumWorkers())
+    ThreadPool(size_t num_threads = DefaultNumWorkers(), const ThreadPoolOptions& options = ThreadPoolOptions())
         : done_(false)
+        , options_(options)
+        , min_workers_(num_threads)
+        , max_workers_(std::max(num_threads, options.max_workers))
+        , placement_(PlacementOrder(options))
+        , injected_(0)
+        , pending_(0)
+        , sleeping_(0)
+        , searching_(0)
+        , live_workers_(0)
+        , workers_(max_workers_)
+        , busy_slots_(max_workers_, false)
+        , space_waiters_(0)
+        , lock_contentions_(0)
+        , timer_epoch_(Clock::now())
+        , timer_wake_(TimingWheel::kNever)
+        , timers_done_(false)
+        , age_check_armed_(false)
     {
-        for (size_t i = 0; i < num_threads; ++i) {
-            workers_.emplace_back(std::thread(&ThreadPool::WorkerThread, this));
+        if (options_.collect_metrics) {
+            for (size_t i = 0; i < max_workers_; ++i) {
+                counters_.emplace_back(new WorkerCounters);
+            }
+        }
+        if (options_.scheduling == SchedulingMode::kWorkStealing) {
+            for (size_t i = 0; i < max_workers_; ++i) {
+                local_queues_.emplace_back(new LocalQueue(this, i));
+            }
+        }
+        for (size_t i = 0; i < max_workers_; ++i) {
+            slots_.emplace_back(new ParkingSlot);
+        }
+        parked_.reserve(max_workers_);
+        std::lock_guard<std::mutex> lock(mtx_);
+        for (size_t i = 0; i < min_workers_; ++i) {
+            Spawn();
         }
     }
 
     ThreadPool(const ThreadPool&) = delete;
     ThreadPool& operator=(const ThreadPool&) = delete;
 
-    std::future<T> Submit(std::function<T()> task) {
-        std::packaged_task<T()> packaged_task(std::move(task));
-        std::future<T> result(packaged_task.get_future());
-        {
-            std::lock_guard<std::mutex> lock(mtx_);
-            if (done_) {
+    // Runs fn(args...) on a worker. fn and args are moved into the task, so
+    // move-only callables are fine.
+    template <class F, class... Args>
+    std::future<InvokeResult<F, Args...>> Submit(F&& fn, Args&&... args) {
+        std::promise<InvokeResult<F, Args...>> promise;
+        auto result = promise.get_future();
+        Push(MakePromiseTask(std::move(promise), std::forward<F>(fn), std::forward<Args>(args)...), true, true);
+        return result;
+    }
+
+    // Like Submit, but a task still queued when token is cancelled is
+    // skipped, and its future fails with TaskCancelledError right away. A
+    // bounded queue that is full first discards its cancelled tasks. A
+    // running task can poll the token to stop early.
+    template <class F, class... Args>
+    std::future<InvokeResult<F, Args...>> Submit(const CancellationToken& token, F&& fn, Args&&... args) {
+        std::promise<InvokeResult<F, Args...>> promise;
+        auto result = promise.get_future();
+        Push(MakeCancellableTask(token, std::move(promise), std::forward<F>(fn), std::forward<Args>(args)...), true, true,
+             token.Flag());
+        return result;
+    }
+
+    // Like Submit, but the result can be chained with Then, WhenAll and
+    // WhenAny instead of blocking a thread in get()
+    template <class F, class... Args>
+    PoolFuture<InvokeResult<F, Args...>> Async(F&& fn, Args&&... args) {
+        using R = InvokeResult<F, Args...>;
+        using Bound = FutureTask<R, typename std::decay<F>::type, typename std::decay<Args>::type...>;
+        auto state = std::make_shared<FutureState<R>>();
+        Push(Task(Bound(state, std::forward<F>(fn), std::forward<Args>(args)...)), true, true);
+        return PoolFuture<R>(this, std::move(state));
+    }
+
+    // Queues every task under a single lock. The returned future completes
+    // once all of them have run, with the first exception any of them threw.
+    template <class F>
+    std::future<void> SubmitBatch(std::vector<F> tasks) {
+        auto batch = std::make_shared<BatchCompletion>(tasks.size());
+        std::future<void> result = batch->GetFuture();
+        std::vector<Task> wrapped;
+        wrapped.reserve(tasks.size());
+        for (auto& task : tasks) {
+            wrapped.emplace_back([batch, task = std::move(task)]() mutable {
+                batch->Run(task);
+            });
+        }
+        PushMany(std::move(wrapped), true);
+        return result;
+    }
+
+    // Calls fn(i) for every i in [begin, end) and returns when all calls
+    // have, rethrowing the first exception. The range is cut into chunks of
+    // at least grain indices; the calling thread takes chunks too.
+    template <class F>
+    void ParallelFor(size_t begin, size_t end, size_t grain, F&& fn,
+                     LoopSchedule schedule = LoopSchedule::kStatic) {
+        if (begin >= end) {
+            return;
+        }
+        using Loop = ParallelLoop<typename std::remove_reference<F>::type>;
+        size_t workers = live_workers_.load();
+        auto loop = std::make_shared<Loop>(begin, end, grain, workers + 1, schedule, fn);
+        std::vector<Task> helpers(loop->Helpers(workers));
+        for (auto& helper : helpers) {
+            helper = Task([loop]() {
+                loop->Run();
+            });
+        }
+        PushMany(std::move(helpers));
+        loop->Run();
+        loop->Wait();
+    }
+
+    // Runs fn on a worker once delay has passed, never earlier, at a
+    // resolution of one TimerTick. Exceptions fn throws are dropped.
+    template <class Rep, class Period, class F>
+    TimerHandle SubmitAfter(const std::chrono::duration<Rep, Period>& delay, F&& fn) {
+        return StartTimer(std::chrono::duration_cast<Clock::duration>(delay), 0, std::forward<F>(fn));
+    }
+
+    // Runs fn every period, the first time one period from now. Runs never
+    // overlap: the ones that would fall while fn is still running or waiting
+    // for a worker are skipped.
+    template <class Rep, class Period, class F>
+    TimerHandle SubmitEvery(const std::chrono::duration<Rep, Period>& period, F&& fn) {
+        uint64_t ticks = Ticks(period);
+        if (ticks == 0) {
+            throw std::invalid_argument("timer period must be positive");
+        }
+        return StartTimer(std::chrono::duration_cast<Clock::duration>(period), ticks, std::forward<F>(fn));
+    }
+
+    // co_await pool.Schedule() continues a coroutine on one of the workers.
+    // The awaiter needs nothing newer than C++14, coroutines themselves need
+    // the C++20 build (see coroutine.h).
+    class ScheduleAwaiter {
+    public:
+        explicit ScheduleAwaiter(ThreadPool* pool)
+            : pool_(pool)
+        {}
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        template <class Handle>
+        void await_suspend(Handle handle) {
+            pool_->Dispatch(Task([handle]() mutable {
+                handle.resume();
+            }));
+        }
+
+        void await_resume() const noexcept {
+        }
+
+    private:
+        ThreadPool* pool_;
+    };
+
+    // Like ScheduleAwaiter, but once delay has passed. No thread waits
+    // meanwhile: the coroutine sits on the timing wheel. If the pool shuts
+    // down first, the coroutine is resumed on a worker all the same and the
+    // co_await throws std::exception, like any use of a shut down pool.
+    class TimerAwaiter {
+    public:
+        TimerAwaiter(ThreadPool* pool, std::chrono::steady_clock::duration delay)
+            : pool_(pool)
+            , delay_(delay)
+            , dropped_(false)
+        {}
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        template <class Handle>
+        void await_suspend(Handle handle) {
+            pool_->StartTimer(delay_, 0, [handle]() mutable {
+                handle.resume();
+            }, Task([this, handle]() mutable {
+                dropped_ = true;
+                handle.resume();
+            }));
+        }
+
+        void await_resume() const {
+            if (dropped_) {
                 throw std::exception();
             }
-            task_queue_.push_back(std::move(packaged_task));
         }
-        condition_.notify_one();
-        return result;
+
+    private:
+        ThreadPool* pool_;
+        std::chrono::steady_clock::duration delay_;
+        bool dropped_;
+    };
+
+    ScheduleAwaiter Schedule() {
+        return ScheduleAwaiter(this);
+    }
+
+    template <class Rep, class Period>
+    TimerAwaiter ScheduleAfter(const std::chrono::duration<Rep, Period>& delay) {
+        return TimerAwaiter(this, std::chrono::duration_cast<std::chrono::steady_clock::duration>(delay));
     }
 
     void Shutdown() {
+        StopTimers();
+        // every parked worker gets its own wakeup
+        std::vector<ParkingSlot*> parked;
         {
             std::lock_guard<std::mutex> lock(mtx_);
             if (done_) return;
             done_ = true;
+            while (ParkingSlot* slot = Unpark()) {
+                parked.push_back(slot);
+            }
+        }
+        for (ParkingSlot* slot : parked) {
+            Wake(slot);
         }
-        condition_.notify_all();
+        space_.notify_all();
         for (auto& worker: workers_) {
-            worker.join();
+            if (worker.joinable()) {
+                worker.join();
+            }
+        }
+    }
+
+    // Safe to call while the pool runs. Without collect_metrics only the
+    // queue depth and the task nodes are filled in.
+    ThreadPoolMetrics Metrics() {
+        ThreadPoolMetrics metrics;
+        metrics.enabled = !counters_.empty();
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            if (local_queues_.empty()) {
+                metrics.queue_depth = task_queue_.size();
+            } else {
+                metrics.queue_depth = std::max<ptrdiff_t>(pending_.load(), 0);
+            }
+        }
+        for (const auto& counters : counters_) {
+            counters->AddTo(metrics);
+        }
+        for (const auto& local : local_queues_) {
+            metrics.task_nodes += local->nodes.load(std::memory_order_relaxed);
         }
+        metrics.lock_contentions = lock_contentions_.load();
+        return metrics;
+    }
+
+    ThreadPoolOverflowStats OverflowStats() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return overflow_;
+    }
+
+    ThreadPoolScalingStats ScalingStats() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        ThreadPoolScalingStats stats = scaling_;
+        stats.live_workers = live_workers_;
+        stats.parked = parked_.size();
+        return stats;
     }
 
     ~ThreadPool() {
@@ -54,32 +385,1068 @@ public:
     }
 
 private:
-    bool done_;
+    template <class T>
+    friend class PoolFuture;
+    friend class TaskGroup;
+    friend class TimerHandle;
+    template <class Key, class Hash>
+    friend class KeyedExecutor;
+
+    using Clock = std::chrono::steady_clock;
+    using TimerTick = std::chrono::milliseconds;
+
+    // Task with its enqueue time, stamped only when elastic or collecting
+    // metrics
+    struct QueuedTask {
+        Task task;
+        Clock::time_point enqueued;
+        bool droppable;  // for OverflowPolicy::kDropOldest
+        const std::atomic<bool>* cancelled = nullptr;  // flag of the token the task was submitted with
+    };
+
+    // A QueuedTask in a worker's deque. Nodes go back to the worker that
+    // pushed them once taken, so nested submission only allocates while a
+    // worker has more tasks in flight than ever before.
+    struct TaskNode {
+        QueuedTask queued;
+        TaskNode* next = nullptr;  // in a free list
+    };
+
+    // Where an idle worker sleeps. notified is set, under mtx_, by whoever
+    // takes the worker off parked_ to wake it.
+    struct ParkingSlot {
+        std::condition_variable cond;
+        bool notified = false;
+    };
+
+    struct LocalQueue {
+        ChaseLevDeque<TaskNode> tasks;
+        ThreadPool* const pool;
+        uint64_t random;
+        TaskNode* free_nodes;  // owner only
+        std::atomic<TaskNode*> returned_nodes;  // given back by thieves
+        std::atomic<size_t> nodes;  // ever allocated
+
+        LocalQueue(ThreadPool* owner, size_t i)
+            : pool(owner)
+            , random(0x9E3779B97F4A7C15ull * (i + 1))
+            , free_nodes(nullptr)
+            , returned_nodes(nullptr)
+            , nodes(0)
+        {}
+
+        ~LocalQueue() {
+            DeleteNodes(free_nodes);
+            DeleteNodes(returned_nodes.load());
+        }
+
+        // Owner only
+        TaskNode* NewNode() {
+            if (!free_nodes) {
+                free_nodes = returned_nodes.exchange(nullptr, std::memory_order_acquire);
+            }
+            if (!free_nodes) {
+                nodes.fetch_add(1, std::memory_order_relaxed);
+                return new TaskNode;
+            }
+            TaskNode* node = free_nodes;
+            free_nodes = node->next;
+            return node;
+        }
+
+        // Owner only
+        void Recycle(TaskNode* node) {
+            node->next = free_nodes;
+            free_nodes = node;
+        }
+
+        // Any thread; takes only pushes, so the owner's exchange is ABA-free
+        void GiveBack(TaskNode* node) {
+            TaskNode* head = returned_nodes.load(std::memory_order_relaxed);
+            do {
+                node->next = head;
+            } while (!returned_nodes.compare_exchange_weak(head, node, std::memory_order_release,
+                                                           std::memory_order_relaxed));
+        }
+
+        static void DeleteNodes(TaskNode* node) {
+            while (node) {
+                TaskNode* next = node->next;
+                delete node;
+                node = next;
+            }
+        }
+
+        // xorshift is plenty to spread thieves over victims
+        size_t NextVictim(size_t n) {
+            random ^= random << 13;
+            random ^= random >> 7;
+            random ^= random << 17;
+            return random % n;
+        }
+    };
+
+    std::atomic<bool> done_;
+    const ThreadPoolOptions options_;
+    const size_t min_workers_;
+    const size_t max_workers_;
+    const std::vector<int> placement_;
     std::mutex mtx_;
-    std::condition_variable condition_;
-    std::deque<std::packaged_task<T()>> task_queue_;
+    std::deque<QueuedTask> task_queue_;
+    std::vector<std::unique_ptr<LocalQueue>> local_queues_;
+    // Work-stealing mode only: tasks in task_queue_
+    std::atomic<size_t> injected_;
+    // Queued tasks in any queue, workers parked, and workers spinning
+    // before they park
+    std::atomic<ptrdiff_t> pending_;
+    std::atomic<size_t> sleeping_;
+    std::atomic<size_t> searching_;
+    // One parking slot per worker slot; parked_ lists the parked ones, most
+    // recently parked last. Guarded by mtx_.
+    std::vector<std::unique_ptr<ParkingSlot>> slots_;
+    std::vector<size_t> parked_;
+    // Worker slots, guarded by mtx_. A retired worker's thread is joined
+    // when its slot is reused.
+    std::atomic<size_t> live_workers_;
     std::vector<std::thread> workers_;
+    std::vector<bool> busy_slots_;
+    ThreadPoolScalingStats scaling_;
+    // Submitters waiting for room in a bounded queue
+    std::condition_variable space_;
+    size_t space_waiters_;
+    ThreadPoolOverflowStats overflow_;
+    // One per worker slot when collecting metrics
+    std::vector<std::unique_ptr<WorkerCounters>> counters_;
+    std::atomic<size_t> lock_contentions_;
+    // Timers: one wheel driven by a timer thread started with the first one
+    std::mutex timer_mtx_;
+    std::condition_variable timer_cond_;
+    TimingWheel timer_wheel_;
+    const Clock::time_point timer_epoch_;
+    uint64_t timer_wake_;
+    bool timers_done_;
+    std::thread timer_thread_;
+    // A backlog age check is on the timer wheel; guarded by mtx_
+    bool age_check_armed_;
 
-    void WorkerThread() {
+    bool Elastic() const {
+        return max_workers_ > min_workers_;
+    }
+
+    void WorkerThread(size_t index) {
+        if (!placement_.empty() && !PinCurrentThread(placement_[index % placement_.size()])) {
+            // an unpinned worker still does its job
+            std::lock_guard<std::mutex> lock(mtx_);
+            ++scaling_.pin_failures;
+        }
+        CurrentPoolSlot() = this;
+        CurrentWorkerIndex() = index;
+        if (!counters_.empty()) {
+            counters_[index]->OnStart();
+        }
+        if (options_.scheduling == SchedulingMode::kWorkStealing) {
+            StealingWorkerThread(index, *local_queues_[index]);
+        } else {
+            SharedQueueWorkerThread(index);
+        }
+        if (!counters_.empty()) {
+            counters_[index]->OnStop();
+        }
+        CurrentPoolSlot() = nullptr;
+    }
+
+    // On a worker thread
+    void Execute(QueuedTask& queued) {
+        if (counters_.empty()) {
+            queued.task();
+            return;
+        }
+        Clock::time_point started = Clock::now();
+        queued.task();
+        counters_[CurrentWorkerIndex()]->OnTask(started - queued.enqueued, Clock::now() - started);
+    }
+
+    // mtx_, counting the times somebody else already held it
+    std::unique_lock<std::mutex> LockQueue() {
+        std::unique_lock<std::mutex> lock(mtx_, std::try_to_lock);
+        if (!lock.owns_lock()) {
+            if (!counters_.empty()) {
+                lock_contentions_.fetch_add(1, std::memory_order_relaxed);
+            }
+            lock.lock();
+        }
+        return lock;
+    }
+
+    Clock::time_point Stamp() const {
+        return Elastic() || !counters_.empty() ? Clock::now() : Clock::time_point();
+    }
+
+    bool IsCurrentWorker() const {
+        return CurrentPoolSlot() == this;
+    }
+
+    // Runs one queued task on the calling worker, if there is any
+    bool RunPendingTask() {
+        QueuedTask queued;
+        LocalQueue* local = CurrentLocalQueue();
+        if (local) {
+            if (!TakeTask(*local, queued)) {
+                return false;
+            }
+            pending_.fetch_sub(1);
+        } else {
+            // newest first, like a worker's own deque: that is most likely
+            // the waiter's own subtask, and it keeps nested waits shallow
+            auto lock = LockQueue();
+            if (task_queue_.empty()) {
+                return false;
+            }
+            queued = std::move(task_queue_.back());
+            task_queue_.pop_back();
+            pending_.fetch_sub(1);
+            OnDequeued();
+        }
+        Execute(queued);
+        return true;
+    }
+
+    void SharedQueueWorkerThread(size_t index) {
         for (;;) {
-            std::packaged_task<T()> task;
+            QueuedTask queued;
+            ParkingSlot* next = nullptr;
             {
-                std::unique_lock<std::mutex> lock(mtx_);
-                condition_.wait(lock, [this] {
-                    return !task_queue_.empty() || done_;
-                });
-                if (done_ && task_queue_.empty()) {
-                    return;
+                auto lock = LockQueue();
+                if (task_queue_.empty()) {
+                    if (done_) {
+                        return;
+                    }
+                    if (!WaitForWork(lock, index)) {
+                        Retire(index);
+                        return;
+                    }
+                    continue;
                 }
-                task = std::move(task_queue_.front());
+                queued = std::move(task_queue_.front());
                 task_queue_.pop_front();
+                pending_.fetch_sub(1);
+                OnDequeued();
+                MaybeGrow();
+                // more work than this worker takes: pass the wakeup on
+                if (!task_queue_.empty()) {
+                    next = PickSleeper();
+                }
             }
+            Wake(next);
+            Execute(queued);
+        }
+    }
+
+    // Yields up to spin_rounds times watching for work, then parks on the
+    // worker's own slot until a submitter picks it or the pool shuts down.
+    // Called and returns with lock held on mtx_. Returns false if this
+    // worker should retire instead: the pool is elastic, above its initial
+    // size, and nothing came within idle_timeout.
+    bool WaitForWork(std::unique_lock<std::mutex>& lock, size_t index) {
+        lock.unlock();
+        searching_.fetch_add(1);
+        for (size_t round = 0; round < options_.spin_rounds && pending_.load() <= 0 && !done_; ++round) {
+            std::this_thread::yield();
+        }
+        lock.lock();
+        // parked before it stops searching and looks once more: a
+        // submitter that saw no one searching then sees it parked
+        parked_.push_back(index);
+        sleeping_.fetch_add(1);
+        searching_.fetch_sub(1);
+        if (pending_.load() > 0 || done_) {
+            Unlist(index);
+            return true;
+        }
+        ParkingSlot& slot = *slots_[index];
+        auto notified = [&slot] {
+            return slot.notified;
+        };
+        bool woken = true;
+        if (!Elastic()) {
+            slot.cond.wait(lock, notified);
+        } else {
+            woken = slot.cond.wait_for(lock, options_.idle_timeout, notified);
+        }
+        if (slot.notified) {
+            slot.notified = false;
+        } else {
+            Unlist(index);
+        }
+        return woken || live_workers_ <= min_workers_;
+    }
+
+    // Under mtx_: takes a worker that woke up by itself off parked_
+    void Unlist(size_t index) {
+        parked_.erase(std::find(parked_.begin(), parked_.end(), index));
+        sleeping_.fetch_sub(1);
+    }
+
+    // Under mtx_: takes the most recently parked worker, the one with the
+    // warmest cache, off parked_ and marks it notified. Wake it once mtx_
+    // is released.
+    ParkingSlot* Unpark() {
+        if (parked_.empty()) {
+            return nullptr;
+        }
+        ParkingSlot* slot = slots_[parked_.back()].get();
+        parked_.pop_back();
+        sleeping_.fetch_sub(1);
+        slot->notified = true;
+        return slot;
+    }
+
+    // Under mtx_, after queueing work: a parked worker to wake for it,
+    // unless a spinning worker is about to find the work by itself
+    ParkingSlot* PickSleeper() {
+        if (searching_.load() > 0) {
+            return nullptr;
+        }
+        ParkingSlot* slot = Unpark();
+        if (slot) {
+            ++scaling_.wakeups;
+        }
+        return slot;
+    }
+
+    static void Wake(ParkingSlot* slot) {
+        if (slot) {
+            slot->cond.notify_one();
+        }
+    }
+
+    // PickSleeper and Wake from outside mtx_; costs no lock while a worker
+    // spins or none is parked
+    void WakeOne() {
+        if (searching_.load() > 0 || sleeping_.load() == 0) {
+            return;
+        }
+        ParkingSlot* slot;
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            slot = PickSleeper();
+        }
+        Wake(slot);
+    }
+
+    // Under mtx_
+    void Spawn() {
+        size_t index = std::find(busy_slots_.begin(), busy_slots_.end(), false) - busy_slots_.begin();
+        if (workers_[index].joinable()) {
+            workers_[index].join();
+        }
+        busy_slots_[index] = true;
+        live_workers_.fetch_add(1);
+        scaling_.peak_workers = std::max(scaling_.peak_workers, live_workers_.load());
+        workers_[index] = std::thread(&ThreadPool::WorkerThread, this, index);
+    }
+
+    // Under mtx_
+    void Retire(size_t index) {
+        busy_slots_[index] = false;
+        live_workers_.fetch_sub(1);
+        ++scaling_.retired;
+    }
+
+    // Under mtx_: adds a worker if the injected backlog has nobody idle to
+    // take it and is too deep or too old
+    void MaybeGrow() {
+        if (!Elastic() || done_ || task_queue_.empty() || sleeping_.load() > 0 || searching_.load() > 0 ||
+            live_workers_ >= max_workers_) {
+            return;
+        }
+        if (task_queue_.size() >= options_.grow_queue_depth) {
+            ++scaling_.grown_for_depth;
+        } else if (Clock::now() - task_queue_.front().enqueued >= options_.grow_queue_age) {
+            ++scaling_.grown_for_age;
+        } else {
+            return;
+        }
+        Spawn();
+    }
+
+    // Under mtx_: whether a backlog waits that only its age could grow the
+    // pool for, with no age check on the wheel yet. Marks one armed.
+    bool NeedAgeCheck() {
+        if (!Elastic() || done_ || age_check_armed_ || task_queue_.empty() || live_workers_ >= max_workers_) {
+            return false;
+        }
+        age_check_armed_ = true;
+        return true;
+    }
+
+    // Runs CheckBacklogAge on the timer thread once the oldest queued task
+    // reaches grow_queue_age. Workers cannot be relied on for it: they may
+    // all be busy, and nothing may be submitted for a while.
+    void ArmAgeCheck() {
+        Clock::time_point oldest;
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            if (task_queue_.empty()) {
+                age_check_armed_ = false;
+                return;
+            }
+            oldest = task_queue_.front().enqueued;
+        }
+        auto state = std::make_shared<TimerState>();
+        state->fn = Task([this]() {
+            CheckBacklogAge();
+        });
+        state->on_timer_thread = true;
+        std::lock_guard<std::mutex> lock(timer_mtx_);
+        // after Shutdown nothing grows any more
+        if (timers_done_) {
+            return;
+        }
+        StartTimerThread();
+        Arm(state, Ticks(oldest + options_.grow_queue_age - timer_epoch_));
+    }
+
+    void CheckBacklogAge() {
+        bool rearm;
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            age_check_armed_ = false;
+            MaybeGrow();
+            rearm = NeedAgeCheck();
+        }
+        if (rearm) {
+            ArmAgeCheck();
+        }
+    }
+
+    void Inject(Task&& task, bool droppable = false, const std::atomic<bool>* cancelled = nullptr) {
+        task_queue_.push_back(QueuedTask{std::move(task), Stamp(), droppable, cancelled});
+    }
+
+    // Under mtx_, after taking a task off task_queue_
+    void OnDequeued() {
+        if (space_waiters_ > 0) {
+            space_.notify_all();
+        }
+    }
+
+    // Makes room in a bounded task_queue_ for count more tasks as the
+    // overflow policy says. Returns false if they are to run on the calling
+    // thread instead. Dropped tasks go to dropped, to be destroyed unlocked.
+    bool Admit(std::unique_lock<std::mutex>& lock, size_t count, std::vector<QueuedTask>& dropped) {
+        size_t capacity = options_.queue_capacity;
+        if (capacity == 0 || task_queue_.size() + count <= capacity) {
+            return true;
+        }
+        if (PurgeCancelled(dropped) > 0 && task_queue_.size() + count <= capacity) {
+            return true;
+        }
+        switch (options_.overflow) {
+        case OverflowPolicy::kBlock:
+            if (IsCurrentWorker()) {
+                // waiting for room could mean waiting for itself
+                ++overflow_.ran_inline;
+                return false;
+            }
+            ++overflow_.blocked;
+            ++space_waiters_;
+            // a batch larger than the bound goes once the queue is empty
+            space_.wait(lock, [this, count, capacity] {
+                return done_ || task_queue_.empty() || task_queue_.size() + count <= capacity;
+            });
+            --space_waiters_;
+            if (done_) {
+                throw std::exception();
+            }
+            return true;
+        case OverflowPolicy::kReject:
+            ++overflow_.rejected;
+            throw TaskRejectedError();
+        case OverflowPolicy::kCallerRuns:
+            overflow_.ran_inline += count;
+            return false;
+        case OverflowPolicy::kDropOldest:
+            if (!CanDropFor(count, capacity)) {
+                ++overflow_.rejected;
+                ++overflow_.undroppable;
+                throw TaskRejectedError();
+            }
+            for (auto it = task_queue_.begin(); it != task_queue_.end() && task_queue_.size() + count > capacity;) {
+                if (!it->droppable) {
+                    ++it;
+                    continue;
+                }
+                dropped.push_back(std::move(*it));
+                it = task_queue_.erase(it);
+                ++overflow_.dropped;
+                pending_.fetch_sub(1);
+                if (!local_queues_.empty()) {
+                    injected_.fetch_sub(1);
+                }
+            }
+            return true;
+        }
+        return true;
+    }
+
+    // Under mtx_: moves the queued tasks whose token is cancelled, and
+    // whose futures have failed already, to purged. Returns their number.
+    size_t PurgeCancelled(std::vector<QueuedTask>& purged) {
+        auto kept = task_queue_.begin();
+        for (auto it = task_queue_.begin(); it != task_queue_.end(); ++it) {
+            if (it->cancelled && it->cancelled->load(std::memory_order_acquire)) {
+                purged.push_back(std::move(*it));
+            } else {
+                if (kept != it) {
+                    *kept = std::move(*it);
+                }
+                ++kept;
+            }
+        }
+        size_t count = task_queue_.end() - kept;
+        if (count > 0) {
+            task_queue_.erase(kept, task_queue_.end());
+            pending_.fetch_sub(count);
+            if (!local_queues_.empty()) {
+                injected_.fetch_sub(count);
+            }
+            OnDequeued();
+        }
+        return count;
+    }
+
+    // Under mtx_: whether dropping queued tasks makes room for count more.
+    // Like kBlock, a batch larger than the bound fits an emptied queue.
+    bool CanDropFor(size_t count, size_t capacity) const {
+        size_t kept = 0;
+        for (const auto& queued : task_queue_) {
+            if (!queued.droppable) {
+                ++kept;
+            }
+        }
+        return kept == 0 || kept + count <= capacity;
+    }
+
+    // bounded: submitted from outside the pool, subject to the queue bound;
+    // droppable: a Submit or Async task kDropOldest may drop; cancelled:
+    // the flag of its token, if any
+    void Push(Task&& task, bool bounded = false, bool droppable = false,
+              const std::atomic<bool>* cancelled = nullptr) {
+        LocalQueue* local = CurrentLocalQueue();
+        if (local) {
+            // a worker's own subtasks stay on its deque until stolen
+            if (done_) {
+                throw std::exception();
+            }
+            TaskNode* node = local->NewNode();
+            node->queued = QueuedTask{std::move(task), Stamp(), false};
+            local->tasks.Push(node);
+            OnTaskPushed();
+            return;
+        }
+        std::vector<QueuedTask> dropped;
+        ParkingSlot* sleeper;
+        bool arm_age_check;
+        {
+            auto lock = LockQueue();
+            if (done_) {
+                throw std::exception();
+            }
+            if (bounded && !Admit(lock, 1, dropped)) {
+                lock.unlock();
+                task();
+                return;
+            }
+            Inject(std::move(task), bounded && droppable, cancelled);
+            if (!local_queues_.empty()) {
+                injected_.fetch_add(1);
+            }
+            pending_.fetch_add(1);
+            MaybeGrow();
+            sleeper = PickSleeper();
+            arm_age_check = NeedAgeCheck();
+        }
+        Wake(sleeper);
+        if (arm_age_check) {
+            ArmAgeCheck();
+        }
+    }
+
+    void PushMany(std::vector<Task>&& tasks, bool bounded = false) {
+        if (tasks.empty()) {
+            return;
+        }
+        LocalQueue* local = CurrentLocalQueue();
+        if (local) {
+            if (done_) {
+                throw std::exception();
+            }
+            Clock::time_point enqueued = Stamp();
+            for (auto& task : tasks) {
+                TaskNode* node = local->NewNode();
+                node->queued = QueuedTask{std::move(task), enqueued, false};
+                local->tasks.Push(node);
+            }
+            OnTaskPushed(tasks.size());
+            return;
+        }
+        std::vector<QueuedTask> dropped;
+        ParkingSlot* sleeper;
+        bool arm_age_check;
+        {
+            auto lock = LockQueue();
+            if (done_) {
+                throw std::exception();
+            }
+            if (bounded && !Admit(lock, tasks.size(), dropped)) {
+                lock.unlock();
+                for (auto& task : tasks) {
+                    task();
+                }
+                return;
+            }
+            for (auto& task : tasks) {
+                Inject(std::move(task));
+            }
+            if (!local_queues_.empty()) {
+                injected_.fetch_add(tasks.size());
+            }
+            pending_.fetch_add(tasks.size());
+            MaybeGrow();
+            // one wakeup; each worker that finds more left wakes the next
+            sleeper = PickSleeper();
+            arm_age_check = NeedAgeCheck();
+        }
+        Wake(sleeper);
+        if (arm_age_check) {
+            ArmAgeCheck();
+        }
+    }
+
+    // Continuations were accepted before a Shutdown, so they still run,
+    // inline if the pool no longer takes tasks
+    void Dispatch(Task&& task) {
+        try {
+            Push(std::move(task));
+        } catch (const std::exception&) {
             task();
         }
     }
 
+    void StealingWorkerThread(size_t index, LocalQueue& local) {
+        CurrentLocalQueueSlot() = &local;
+        for (;;) {
+            QueuedTask queued;
+            if (TakeTask(local, queued)) {
+                // more work than this worker takes: pass the wakeup on
+                if (pending_.fetch_sub(1) > 1) {
+                    WakeOne();
+                }
+                Execute(queued);
+                continue;
+            }
+            auto lock = LockQueue();
+            // only the owner pushes to a deque, so an exiting or retiring
+            // worker leaves nothing behind in its own
+            if (done_ && pending_.load() <= 0) {
+                break;
+            }
+            if (!WaitForWork(lock, index)) {
+                Retire(index);
+                break;
+            }
+        }
+        CurrentLocalQueueSlot() = nullptr;
+    }
+
+    // Own deque first, then the injector, then the other workers' deques
+    bool TakeTask(LocalQueue& local, QueuedTask& queued) {
+        if (TaskNode* own = local.tasks.Pop()) {
+            queued = std::move(own->queued);
+            local.Recycle(own);
+            return true;
+        }
+        if (injected_.load() > 0) {
+            auto lock = LockQueue();
+            if (!task_queue_.empty()) {
+                queued = std::move(task_queue_.front());
+                task_queue_.pop_front();
+                OnDequeued();
+                injected_.fetch_sub(1);
+                MaybeGrow();
+                return true;
+            }
+        }
+        size_t n = local_queues_.size();
+        size_t first = local.NextVictim(n);
+        for (size_t i = 0; i < n; ++i) {
+            LocalQueue& victim = *local_queues_[(first + i) % n];
+            if (&victim == &local) {
+                continue;
+            }
+            if (TaskNode* stolen = victim.tasks.Steal()) {
+                CountSteal(true);
+                queued = std::move(stolen->queued);
+                victim.GiveBack(stolen);
+                return true;
+            }
+        }
+        CountSteal(false);
+        return false;
+    }
+
+    void CountSteal(bool stolen) {
+        if (!counters_.empty()) {
+            counters_[CurrentWorkerIndex()]->OnSteal(stolen);
+        }
+    }
+
+    void OnTaskPushed(size_t count = 1) {
+        pending_.fetch_add(count);
+        WakeOne();
+    }
+
+    static const ThreadPool*& CurrentPoolSlot() {
+        static thread_local const ThreadPool* pool = nullptr;
+        return pool;
+    }
+
+    // Slot of the calling worker, meaningful only on a worker thread
+    static size_t& CurrentWorkerIndex() {
+        static thread_local size_t index = 0;
+        return index;
+    }
+
+    static LocalQueue*& CurrentLocalQueueSlot() {
+        static thread_local LocalQueue* local = nullptr;
+        return local;
+    }
+
+    // The calling worker's deque, if it is a worker of this pool
+    LocalQueue* CurrentLocalQueue() {
+        LocalQueue* local = CurrentLocalQueueSlot();
+        return local && local->pool == this ? local : nullptr;
+    }
+
+    // Whole ticks in d, rounded up
+    template <class Rep, class Period>
+    static uint64_t Ticks(const std::chrono::duration<Rep, Period>& d) {
+        auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+        auto tick = std::chrono::duration_cast<std::chrono::nanoseconds>(TimerTick(1)).count();
+        return nanos > 0 ? (nanos + tick - 1) / tick : 0;
+    }
+
+    // Ticks since timer_epoch_ that have fully passed
+    uint64_t ElapsedTicks() const {
+        return std::chrono::duration_cast<TimerTick>(Clock::now() - timer_epoch_).count();
+    }
+
+    template <class F>
+    TimerHandle StartTimer(Clock::duration delay, uint64_t period, F&& fn, Task&& on_drop = Task()) {
+        auto state = std::make_shared<TimerState>();
+        state->fn = Task(std::forward<F>(fn));
+        state->on_drop = std::move(on_drop);
+        state->period = period;
+        std::lock_guard<std::mutex> lock(timer_mtx_);
+        if (timers_done_) {
+            throw std::exception();
+        }
+        StartTimerThread();
+        // the delay counts from now, not from the last full tick
+        uint64_t deadline = Ticks(Clock::now() - timer_epoch_ + delay);
+        Arm(state, deadline);
+        return TimerHandle(this, std::move(state));
+    }
+
+    // Under timer_mtx_
+    void StartTimerThread() {
+        if (!timer_thread_.joinable()) {
+            timer_thread_ = std::thread(&ThreadPool::TimerThread, this);
+        }
+    }
+
+    // Under timer_mtx_
+    void Arm(const std::shared_ptr<TimerState>& state, uint64_t deadline) {
+        state->self = state;
+        timer_wheel_.Schedule(state.get(), deadline);
+        if (state->deadline < timer_wake_) {
+            timer_cond_.notify_one();
+        }
+    }
+
+    void TimerThread() {
+        std::vector<std::shared_ptr<TimerState>> due;
+        std::unique_lock<std::mutex> lock(timer_mtx_);
+        while (!timers_done_) {
+            timer_wheel_.Advance(ElapsedTicks(), [&due](TimerNode* node) {
+                due.push_back(std::move(static_cast<TimerState*>(node)->self));
+            });
+            if (!due.empty()) {
+                lock.unlock();
+                for (auto& state : due) {
+                    if (state->on_timer_thread) {
+                        RunTimer(state);
+                        continue;
+                    }
+                    Dispatch(Task([this, state]() {
+                        RunTimer(state);
+                    }));
+                }
+                due.clear();
+                lock.lock();
+                continue;
+            }
+            timer_wake_ = timer_wheel_.NextEvent();
+            if (timer_wake_ == TimingWheel::kNever) {
+                timer_cond_.wait(lock);
+            } else {
+                timer_cond_.wait_until(lock, timer_epoch_ + TimerTick(timer_wake_));
+            }
+            timer_wake_ = 0;
+        }
+    }
+
+    void RunTimer(const std::shared_ptr<TimerState>& state) {
+        if (state->period) {
+            std::lock_guard<std::mutex> lock(timer_mtx_);
+            if (state->cancelled) {
+                return;
+            }
+        }
+        try {
+            state->fn();
+        } catch (...) {
+        }
+        if (!state->period) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(timer_mtx_);
+        if (state->cancelled || timers_done_) {
+            return;
+        }
+        uint64_t deadline = state->deadline + state->period;
+        uint64_t now = ElapsedTicks();
+        if (deadline <= now) {
+            deadline += (now - deadline) / state->period * state->period + state->period;
+        }
+        Arm(state, deadline);
+    }
+
+    bool CancelTimer(TimerState& state) {
+        std::lock_guard<std::mutex> lock(timer_mtx_);
+        if (state.cancelled) {
+            return false;
+        }
+        state.cancelled = true;
+        if (state.Linked()) {
+            timer_wheel_.Cancel(&state);
+            state.self.reset();
+            return true;
+        }
+        // a one-shot timer off the wheel has fired
+        return state.period != 0;
+    }
+
+    // Pending timers are dropped, their on_drop handed to the workers, which
+    // are still running; runs already handed to workers still happen
+    void StopTimers() {
+        std::vector<std::shared_ptr<TimerState>> dropped;
+        {
+            std::lock_guard<std::mutex> lock(timer_mtx_);
+            if (timers_done_) {
+                return;
+            }
+            timers_done_ = true;
+            timer_wheel_.Clear([&dropped](TimerNode* node) {
+                dropped.push_back(std::move(static_cast<TimerState*>(node)->self));
+            });
+        }
+        timer_cond_.notify_all();
+        if (timer_thread_.joinable()) {
+            timer_thread_.join();
+        }
+        for (auto& state : dropped) {
+            if (state->on_drop) {
+                Dispatch(std::move(state->on_drop));
+            }
+        }
+    }
+
+    static std::vector<int> PlacementOrder(const ThreadPoolOptions& options) {
+        if (options.placement == PlacementPolicy::kNone) {
+            return std::vector<int>();
+        }
+        const CpuTopology topology = options.topology.Cpus().empty() ? CpuTopology::Current() : options.topology;
+        std::vector<int> order = topology.Order(options.placement, options.cpus);
+        if (order.empty()) {
+            throw std::invalid_argument("no cpus to place workers on");
+        }
+        return order;
+    }
+
     static size_t DefaultNumWorkers() {
         size_t num_threads = std::thread::hardware_concurrency();
         return (num_threads ? num_threads : 4);
     }
 };
+
+///////////////////////////////////////////////////////////////////////
+
+// Runs a Then continuation, or passes the error of the source along
+template <class T, class R, class F>
+void Continue(FutureState<T>& source, FutureState<R>& next, F& fn, std::false_type) {
+    if (std::exception_ptr error = source.Error()) {
+        next.SetException(error);
+        return;
+    }
+    FulfilWith(next, fn, source.Take());
+}
+
+template <class T, class R, class F>
+void Continue(FutureState<T>& source, FutureState<R>& next, F& fn, std::true_type) {
+    if (std::exception_ptr error = source.Error()) {
+        next.SetException(error);
+        return;
+    }
+    FulfilWith(next, fn);
+}
+
+template <class T>
+template <class F>
+PoolFuture<ThenResult<T, F>> PoolFuture<T>::Then(F&& fn) {
+    using R = ThenResult<T, F>;
+    std::shared_ptr<FutureState<T>> source = FutureAccess::Release(*this);
+    auto next = std::make_shared<FutureState<R>>();
+    ThreadPool* pool = pool_;
+    FutureState<T>* raw = source.get();
+    raw->OnReady([pool, source, next, fn = typename std::decay<F>::type(std::forward<F>(fn))]() mutable {
+        Task step([source, next, fn = std::move(fn)]() mutable {
+            Continue(*source, *next, fn, std::is_void<T>());
+        });
+        if (pool) {
+            pool->Dispatch(std::move(step));
+        } else {
+            step();
+        }
+    });
+    return PoolFuture<R>(pool, std::move(next));
+}
+
+inline bool TimerHandle::Cancel() {
+    return state_ && pool_->CancelTimer(*state_);
+}
+
+///////////////////////////////////////////////////////////////////////
+
+// Fork-join group of tasks on a pool. Wait called from one of the pool's
+// workers runs other queued tasks until the group is done instead of
+// blocking the worker, so recursive divide and conquer cannot starve the
+// pool. When there is nothing to run it sleeps until a task of the group
+// finishes or queues another.
+class TaskGroup {
+public:
+    explicit TaskGroup(ThreadPool& pool)
+        : pool_(pool)
+        , pending_(0)
+        , events_(0)
+        , helpers_(0)
+    {}
+
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    // The tasks reference the group, so it outlives them
+    ~TaskGroup() {
+        WaitForTasks();
+    }
+
+    template <class F>
+    void Run(F&& fn) {
+        pending_.fetch_add(1);
+        try {
+            pool_.Push(Task([this, fn = typename std::decay<F>::type(std::forward<F>(fn))]() mutable {
+                try {
+                    fn();
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(mtx_);
+                    if (!error_) {
+                        error_ = std::current_exception();
+                    }
+                }
+                Finish();
+            }));
+        } catch (...) {
+            Finish();
+            throw;
+        }
+        std::lock_guard<std::mutex> lock(mtx_);
+        Signal();
+    }
+
+    // Returns once every task has run, rethrowing the first exception
+    void Wait() {
+        WaitForTasks();
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (error_) {
+            std::exception_ptr error = error_;
+            error_ = nullptr;
+            std::rethrow_exception(error);
+        }
+    }
+
+private:
+    ThreadPool& pool_;
+    std::atomic<size_t> pending_;
+    std::mutex mtx_;
+    std::condition_variable done_;
+    // Under mtx_: tasks queued or finished so far, and workers waiting to
+    // help with the next one
+    size_t events_;
+    size_t helpers_;
+    std::exception_ptr error_;
+
+    // Returns with mtx_ taken once after the last Finish, so that the group
+    // outlives its use by that Finish
+    void WaitForTasks() {
+        std::unique_lock<std::mutex> lock(mtx_);
+        if (!pool_.IsCurrentWorker()) {
+            done_.wait(lock, [this] {
+                return pending_.load() == 0;
+            });
+            return;
+        }
+        while (pending_.load() > 0) {
+            size_t seen = events_;
+            lock.unlock();
+            bool ran = pool_.RunPendingTask();
+            lock.lock();
+            if (!ran) {
+                // the rest is running elsewhere, or not yet visible: wait
+                // for one of them to finish or to queue more
+                ++helpers_;
+                done_.wait(lock, [this, seen] {
+                    return pending_.load() == 0 || events_ != seen;
+                });
+                --helpers_;
+            }
+        }
+    }
+
+    void Finish() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (pending_.fetch_sub(1) == 1) {
+            done_.notify_all();
+        } else {
+            Signal();
+        }
+    }
+
+    // Under mtx_
+    void Signal() {
+        ++events_;
+        if (helpers_ > 0) {
+            done_.notify_all();
+        }
+    }
+};
@@ -0,0 +1,159 @@
+#pragma once
+
+#include "solution.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Runs the tasks submitted under one key one at a time and in submission
+// order, while different keys run in parallel on the pool. A key is only
+// tracked while it has work: the first task submitted under an idle key
+// queues a runner on the pool, and that runner works through the key's tasks
+// until none are left, so there is never more than one runner per key and no
+// worker ever blocks waiting for another one. After kBatch tasks in a row a
+// runner goes back to the end of the pool's queue to let other work in.
+// Submit queues a runner the way ThreadPool::Submit queues a task: it throws
+// after Shutdown and is subject to the pool's queue bound. Tasks once
+// accepted, even if queued when the executor is destroyed, run anyway.
+template <class Key, class Hash = std::hash<Key>>
+class KeyedExecutor {
+public:
+    static constexpr size_t kBatch = 64;
+
+    explicit KeyedExecutor(ThreadPool& pool, size_t shards = 16)
+        : state_(std::make_shared<State>(pool, std::max<size_t>(shards, 1)))
+    {}
+
+    KeyedExecutor(const KeyedExecutor&) = delete;
+    KeyedExecutor& operator=(const KeyedExecutor&) = delete;
+
+    template <class F, class... Args>
+    std::future<InvokeResult<F, Args...>> Submit(const Key& key, F&& fn, Args&&... args) {
+        std::promise<InvokeResult<F, Args...>> promise;
+        auto result = promise.get_future();
+        Post(key, MakePromiseTask(std::move(promise), std::forward<F>(fn), std::forward<Args>(args)...));
+        return result;
+    }
+
+    // Keys with tasks queued or running
+    size_t ActiveKeys() const {
+        size_t active = 0;
+        for (auto& shard : state_->shards) {
+            std::lock_guard<std::mutex> lock(shard.mtx);
+            active += shard.queues.size();
+        }
+        return active;
+    }
+
+private:
+    // A key is in queues exactly while its runner is on the pool
+    struct Shard {
+        mutable std::mutex mtx;
+        std::unordered_map<Key, std::deque<Task>, Hash> queues;
+    };
+
+    struct State {
+        State(ThreadPool& pool, size_t shards)
+            : pool(pool)
+            , shards(shards)
+        {}
+
+        ThreadPool& pool;
+        Hash hash;
+        std::vector<Shard> shards;
+
+        Shard& ShardOf(const Key& key) {
+            return shards[hash(key) % shards.size()];
+        }
+    };
+
+    std::shared_ptr<State> state_;
+
+    void Post(const Key& key, Task&& task) {
+        Shard& shard = state_->ShardOf(key);
+        {
+            std::lock_guard<std::mutex> lock(shard.mtx);
+            auto it = shard.queues.find(key);
+            if (it != shard.queues.end()) {
+                it->second.push_back(std::move(task));
+                return;
+            }
+            shard.queues[key].push_back(std::move(task));
+        }
+        try {
+            state_->pool.Push(Runner(state_, key), true);
+        } catch (...) {
+            // tasks that joined the key meanwhile have lost the race too:
+            // their futures fail with broken_promise
+            std::deque<Task> refused;
+            {
+                std::lock_guard<std::mutex> lock(shard.mtx);
+                auto it = shard.queues.find(key);
+                refused.swap(it->second);
+                shard.queues.erase(it);
+            }
+            throw;
+        }
+    }
+
+    static Task Runner(const std::shared_ptr<State>& state, const Key& key) {
+        return Task([state, key]() {
+            Drain(state, key);
+        });
+    }
+
+    static void Drain(const std::shared_ptr<State>& state, const Key& key) {
+        Shard& shard = state->ShardOf(key);
+        for (size_t ran = 0;; ++ran) {
+            Task task;
+            {
+                std::lock_guard<std::mutex> lock(shard.mtx);
+                auto it = shard.queues.find(key);
+                if (it->second.empty()) {
+                    shard.queues.erase(it);
+                    return;
+                }
+                if (ran == kBatch) {
+                    break;
+                }
+                task = std::move(it->second.front());
+                it->second.pop_front();
+            }
+            // a promise task, so it never throws
+            task();
+        }
+        // its tasks were accepted, so after a Shutdown they run inline
+        state->pool.Dispatch(Runner(state, key));
+    }
+};
+
+template <class Key, class Hash>
+constexpr size_t KeyedExecutor<Key, Hash>::kBatch;
+
+// A KeyedExecutor of a single key: its tasks run one at a time, in order
+class Strand {
+public:
+    explicit Strand(ThreadPool& pool)
+        : executor_(pool, 1)
+    {}
+
+    template <class F, class... Args>
+    std::future<InvokeResult<F, Args...>> Submit(F&& fn, Args&&... args) {
+        return executor_.Submit(0, std::forward<F>(fn), std::forward<Args>(args)...);
+    }
+
+    bool Idle() const {
+        return executor_.ActiveKeys() == 0;
+    }
+
+private:
+    KeyedExecutor<int> executor_;
+};
@@ -0,0 +1,218 @@
+#pragma once
+
+#include <cstddef>
+#include <exception>
+#include <future>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+// Move-only type-erased void() callable. Callables of up to kInlineSize
+// bytes that are nothrow movable live inside the Task itself, larger ones
+// are moved to the heap.
+class Task {
+public:
+    static constexpr size_t kInlineSize = 64;
+
+    Task() noexcept
+        : ops_(nullptr)
+    {}
+
+    template <class F, class = typename std::enable_if<!std::is_same<typename std::decay<F>::type, Task>::value>::type>
+    Task(F&& fn)
+        : ops_(nullptr)
+    {
+        using Fn = typename std::decay<F>::type;
+        Construct<Fn>(std::forward<F>(fn), std::integral_constant<bool, FitsInline<Fn>()>());
+    }
+
+    Task(Task&& other) noexcept
+        : ops_(nullptr)
+    {
+        *this = std::move(other);
+    }
+
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            Reset();
+            if (other.ops_) {
+                other.ops_->move(&other.storage_, &storage_);
+                ops_ = other.ops_;
+                other.ops_ = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task() {
+        Reset();
+    }
+
+    explicit operator bool() const {
+        return ops_ != nullptr;
+    }
+
+    bool IsInline() const {
+        return ops_ && ops_->is_inline;
+    }
+
+    void operator()() {
+        ops_->invoke(&storage_);
+    }
+
+    void Reset() {
+        if (ops_) {
+            ops_->destroy(&storage_);
+            ops_ = nullptr;
+        }
+    }
+
+private:
+    using Storage = typename std::aligned_storage<kInlineSize, alignof(std::max_align_t)>::type;
+
+    struct Ops {
+        void (*invoke)(void* storage);
+        void (*move)(void* from, void* to);
+        void (*destroy)(void* storage);
+        bool is_inline;
+    };
+
+    template <class Fn>
+    static constexpr bool FitsInline() {
+        return sizeof(Fn) <= kInlineSize
+            && alignof(Fn) <= alignof(std::max_align_t)
+            && std::is_nothrow_move_constructible<Fn>::value;
+    }
+
+    template <class Fn>
+    struct InlineOps {
+        static Fn* Get(void* storage) {
+            return static_cast<Fn*>(storage);
+        }
+
+        static void Invoke(void* storage) {
+            (*Get(storage))();
+        }
+
+        static void Move(void* from, void* to) {
+            new (to) Fn(std::move(*Get(from)));
+            Get(from)->~Fn();
+        }
+
+        static void Destroy(void* storage) {
+            Get(storage)->~Fn();
+        }
+
+        static constexpr Ops ops = {&Invoke, &Move, &Destroy, true};
+    };
+
+    template <class Fn>
+    struct HeapOps {
+        static Fn*& Get(void* storage) {
+            return *static_cast<Fn**>(storage);
+        }
+
+        static void Invoke(void* storage) {
+            (*Get(storage))();
+        }
+
+        static void Move(void* from, void* to) {
+            new (to) Fn*(Get(from));
+        }
+
+        static void Destroy(void* storage) {
+            delete Get(storage);
+        }
+
+        static constexpr Ops ops = {&Invoke, &Move, &Destroy, false};
+    };
+
+    Storage storage_;
+    const Ops* ops_;
+
+    template <class Fn, class F>
+    void Construct(F&& fn, std::true_type) {
+        new (&storage_) Fn(std::forward<F>(fn));
+        ops_ = &InlineOps<Fn>::ops;
+    }
+
+    template <class Fn, class F>
+    void Construct(F&& fn, std::false_type) {
+        new (&storage_) Fn*(new Fn(std::forward<F>(fn)));
+        ops_ = &HeapOps<Fn>::ops;
+    }
+};
+
+template <class Fn>
+constexpr Task::Ops Task::InlineOps<Fn>::ops;
+
+template <class Fn>
+constexpr Task::Ops Task::HeapOps<Fn>::ops;
+
+///////////////////////////////////////////////////////////////////////
+
+// Type of F called with Args; std::result_of is gone from C++20
+#if defined(__cpp_lib_is_invocable)
+template <class F, class... Args>
+using CallResult = typename std::invoke_result<F, Args...>::type;
+#else
+template <class F, class... Args>
+using CallResult = typename std::result_of<F(Args...)>::type;
+#endif
+
+// What Submit(f, args...) resolves to: f called with decayed copies of args
+template <class F, class... Args>
+using InvokeResult = CallResult<typename std::decay<F>::type, typename std::decay<Args>::type...>;
+
+// Runs fn(args...) once and fulfils the promise with the value or the
+// exception, like std::packaged_task, but without a second type-erased
+// copy of fn inside the shared state.
+template <class R, class F, class... Args>
+class PromiseTask {
+public:
+    template <class G, class... A>
+    PromiseTask(std::promise<R>&& promise, G&& fn, A&&... args)
+        : promise_(std::move(promise))
+        , fn_(std::forward<G>(fn))
+        , args_(std::forward<A>(args)...)
+    {}
+
+    void operator()() {
+        try {
+            Fulfil(std::is_void<R>(), std::index_sequence_for<Args...>());
+        } catch (...) {
+            promise_.set_exception(std::current_exception());
+        }
+    }
+
+    // Fails the promise with error instead of running fn
+    void Fail(std::exception_ptr error) {
+        promise_.set_exception(std::move(error));
+    }
+
+private:
+    std::promise<R> promise_;
+    F fn_;
+    std::tuple<Args...> args_;
+
+    template <size_t... I>
+    void Fulfil(std::false_type, std::index_sequence<I...>) {
+        promise_.set_value(fn_(std::get<I>(std::move(args_))...));
+    }
+
+    template <size_t... I>
+    void Fulfil(std::true_type, std::index_sequence<I...>) {
+        fn_(std::get<I>(std::move(args_))...);
+        promise_.set_value();
+    }
+};
+
+template <class R, class F, class... Args>
+Task MakePromiseTask(std::promise<R>&& promise, F&& fn, Args&&... args) {
+    using Bound = PromiseTask<R, typename std::decay<F>::type, typename std::decay<Args>::type...>;
+    return Task(Bound(std::move(promise), std::forward<F>(fn), std::forward<Args>(args)...));
+}
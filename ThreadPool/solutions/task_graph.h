@@ -0,0 +1,166 @@
+#pragma once
+
+#include "solution.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+// Where a node's run fell within the last Run of its graph
+struct TaskGraphNodeTiming {
+    bool ran = false;                   // false if an earlier failure skipped it
+    std::chrono::nanoseconds start{0};  // since Run began
+    std::chrono::nanoseconds duration{0};
+};
+
+// Dependency graph of tasks, built once and run as often as needed. Every
+// node counts down the dependencies it still waits for; the node finishing
+// last queues it on the pool right away, so no thread ever blocks on a
+// dependency. After a node throws, nodes that have not started yet are
+// skipped. A graph must not be changed or run again while it runs.
+class TaskGraph {
+public:
+    TaskGraph()
+        : checked_(true)
+    {}
+
+    TaskGraph(const TaskGraph&) = delete;
+    TaskGraph& operator=(const TaskGraph&) = delete;
+
+    // fn is called once per Run; returns the node's id
+    template <class F>
+    size_t Add(F&& fn) {
+        nodes_.emplace_back(new Node(Task(std::forward<F>(fn))));
+        return nodes_.size() - 1;
+    }
+
+    // node runs only once dependency has
+    void AddDependency(size_t node, size_t dependency) {
+        nodes_.at(dependency)->successors.push_back(node);
+        ++nodes_.at(node)->dependencies;
+        checked_ = false;
+    }
+
+    size_t Size() const {
+        return nodes_.size();
+    }
+
+    // Runs every node on pool and returns once all have run, rethrowing the
+    // first exception. On a worker of pool it runs queued tasks meanwhile.
+    // Throws std::invalid_argument if the dependencies form a cycle.
+    void Run(ThreadPool& pool) {
+        if (!checked_) {
+            CheckAcyclic();
+        }
+        for (auto& node : nodes_) {
+            node->waiting.store(node->dependencies, std::memory_order_relaxed);
+            node->timing = TaskGraphNodeTiming();
+        }
+        Execution execution(pool);
+        for (size_t id = 0; id < nodes_.size(); ++id) {
+            if (nodes_[id]->dependencies == 0) {
+                Schedule(execution, id);
+            }
+        }
+        execution.group.Wait();
+    }
+
+    // Of the last Run
+    const TaskGraphNodeTiming& Timing(size_t node) const {
+        return nodes_.at(node)->timing;
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Node {
+        explicit Node(Task&& fn)
+            : fn(std::move(fn))
+            , dependencies(0)
+            , waiting(0)
+        {}
+
+        Task fn;
+        std::vector<size_t> successors;
+        size_t dependencies;
+        // dependencies not yet run in the current Run
+        std::atomic<size_t> waiting;
+        TaskGraphNodeTiming timing;
+    };
+
+    struct Execution {
+        explicit Execution(ThreadPool& pool)
+            : group(pool)
+            , failed(false)
+            , started(Clock::now())
+        {}
+
+        TaskGroup group;
+        std::atomic<bool> failed;
+        const Clock::time_point started;
+    };
+
+    std::vector<std::unique_ptr<Node>> nodes_;
+    bool checked_;
+
+    void Schedule(Execution& execution, size_t id) {
+        execution.group.Run([this, &execution, id]() {
+            RunNode(execution, id);
+        });
+    }
+
+    void RunNode(Execution& execution, size_t id) {
+        if (execution.failed.load()) {
+            return;
+        }
+        Node& node = *nodes_[id];
+        Clock::time_point started = Clock::now();
+        node.timing.ran = true;
+        node.timing.start = started - execution.started;
+        try {
+            node.fn();
+        } catch (...) {
+            node.timing.duration = Clock::now() - started;
+            execution.failed.store(true);
+            throw;
+        }
+        node.timing.duration = Clock::now() - started;
+        for (size_t successor : node.successors) {
+            if (nodes_[successor]->waiting.fetch_sub(1) == 1) {
+                Schedule(execution, successor);
+            }
+        }
+    }
+
+    // Kahn's algorithm: a cycle leaves some node with dependencies that
+    // never run
+    void CheckAcyclic() {
+        std::vector<size_t> waiting;
+        std::vector<size_t> ready;
+        for (size_t id = 0; id < nodes_.size(); ++id) {
+            waiting.push_back(nodes_[id]->dependencies);
+            if (waiting.back() == 0) {
+                ready.push_back(id);
+            }
+        }
+        size_t sorted = 0;
+        while (!ready.empty()) {
+            size_t id = ready.back();
+            ready.pop_back();
+            ++sorted;
+            for (size_t successor : nodes_[id]->successors) {
+                if (--waiting[successor] == 0) {
+                    ready.push_back(successor);
+                }
+            }
+        }
+        if (sorted != nodes_.size()) {
+            throw std::invalid_argument("task graph has a cycle");
+        }
+        checked_ = true;
+    }
+};
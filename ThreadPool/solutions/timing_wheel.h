@@ -0,0 +1,242 @@
+#pragma once
+
+#include "task.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+
+// Intrusive entry of a TimingWheel, unlinked unless prev is set
+struct TimerNode {
+    TimerNode* prev = nullptr;
+    TimerNode* next = nullptr;
+    uint64_t deadline = 0;
+    size_t level = 0;
+    size_t slot = 0;
+
+    bool Linked() const {
+        return prev != nullptr;
+    }
+};
+
+// Hierarchical timing wheel over integer ticks. Level l has kSlots slots of
+// kSlots^l ticks each and holds the nodes whose deadline shares every digit
+// above level l with the current tick; a node moves down a level when its
+// slot comes up. Deadlines beyond the top level wait in an overflow list
+// that is looked at once per top level revolution. Scheduling and
+// cancelling are O(1), and Advance skips over empty slots using the
+// per-level occupancy masks. Not thread-safe.
+class TimingWheel {
+public:
+    static constexpr size_t kSlotBits = 6;
+    static constexpr size_t kSlots = size_t(1) << kSlotBits;
+    static constexpr size_t kLevels = 4;
+    static constexpr uint64_t kNever = std::numeric_limits<uint64_t>::max();
+
+    TimingWheel()
+        : now_(0)
+        , size_(0)
+        , occupied_()
+    {
+        for (auto& level : slots_) {
+            for (auto& slot : level) {
+                slot.prev = slot.next = &slot;
+            }
+        }
+        overflow_.prev = overflow_.next = &overflow_;
+    }
+
+    TimingWheel(const TimingWheel&) = delete;
+    TimingWheel& operator=(const TimingWheel&) = delete;
+
+    uint64_t Now() const {
+        return now_;
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    bool Empty() const {
+        return size_ == 0;
+    }
+
+    // Due at deadline, or on the next tick if that has already come
+    void Schedule(TimerNode* node, uint64_t deadline) {
+        node->deadline = std::max(deadline, now_ + 1);
+        Place(node);
+        ++size_;
+    }
+
+    void Cancel(TimerNode* node) {
+        Unlink(node);
+        --size_;
+    }
+
+    // First tick after Now() at which Advance has something to expire or to
+    // move down a level, kNever if the wheel is empty
+    uint64_t NextEvent() const {
+        uint64_t next = kNever;
+        for (size_t level = 0; level < kLevels; ++level) {
+            size_t shift = level * kSlotBits;
+            size_t current = (now_ >> shift) & kSlotMask;
+            // slots at or behind the current one are empty at every level
+            uint64_t ahead = occupied_[level] & ~((uint64_t(2) << current) - 1);
+            if (ahead) {
+                uint64_t revolution = now_ >> (shift + kSlotBits) << (shift + kSlotBits);
+                next = std::min(next, revolution + (uint64_t(__builtin_ctzll(ahead)) << shift));
+            }
+        }
+        if (overflow_.next != &overflow_) {
+            next = std::min(next, ((now_ >> kTopShift) + 1) << kTopShift);
+        }
+        return next;
+    }
+
+    // Moves the wheel to tick and hands every node due by then to
+    // expire(node), in deadline order. The callback may schedule again.
+    template <class F>
+    void Advance(uint64_t tick, F&& expire) {
+        while (now_ < tick) {
+            now_ = std::min(tick, NextEvent());
+            Cascade();
+            TimerNode& due = slots_[0][now_ & kSlotMask];
+            while (due.next != &due) {
+                TimerNode* node = due.next;
+                Cancel(node);
+                expire(node);
+            }
+        }
+    }
+
+    // Unlinks every node, handing each to fn(node)
+    template <class F>
+    void Clear(F&& fn) {
+        for (auto& level : slots_) {
+            for (auto& slot : level) {
+                Drain(slot, fn);
+            }
+        }
+        Drain(overflow_, fn);
+    }
+
+private:
+    static constexpr uint64_t kSlotMask = kSlots - 1;
+    static constexpr size_t kTopShift = kLevels * kSlotBits;
+
+    uint64_t now_;
+    size_t size_;
+    uint64_t occupied_[kLevels];
+    TimerNode slots_[kLevels][kSlots];
+    TimerNode overflow_;
+
+    void Place(TimerNode* node) {
+        size_t level = 0;
+        while (level < kLevels && (node->deadline >> ((level + 1) * kSlotBits)) != (now_ >> ((level + 1) * kSlotBits))) {
+            ++level;
+        }
+        node->level = level;
+        node->slot = level < kLevels ? (node->deadline >> (level * kSlotBits)) & kSlotMask : 0;
+        TimerNode& head = level < kLevels ? slots_[level][node->slot] : overflow_;
+        node->prev = head.prev;
+        node->next = &head;
+        head.prev->next = node;
+        head.prev = node;
+        if (level < kLevels) {
+            occupied_[level] |= uint64_t(1) << node->slot;
+        }
+    }
+
+    void Unlink(TimerNode* node) {
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        node->prev = node->next = nullptr;
+        if (node->level < kLevels) {
+            TimerNode& head = slots_[node->level][node->slot];
+            if (head.next == &head) {
+                occupied_[node->level] &= ~(uint64_t(1) << node->slot);
+            }
+        }
+    }
+
+    // Re-places the nodes of every slot whose span starts at now_, top
+    // level first; they all land on lower levels
+    void Cascade() {
+        if ((now_ & ((uint64_t(1) << kTopShift) - 1)) == 0) {
+            Replace(overflow_);
+        }
+        for (size_t level = kLevels; level-- > 1;) {
+            size_t shift = level * kSlotBits;
+            if ((now_ & ((uint64_t(1) << shift) - 1)) == 0) {
+                Replace(slots_[level][(now_ >> shift) & kSlotMask]);
+            }
+        }
+    }
+
+    void Replace(TimerNode& head) {
+        // nodes still beyond the top level go back to the end of overflow_
+        for (size_t count = Count(head); count > 0; --count) {
+            TimerNode* node = head.next;
+            Unlink(node);
+            Place(node);
+        }
+    }
+
+    static size_t Count(const TimerNode& head) {
+        size_t count = 0;
+        for (const TimerNode* node = head.next; node != &head; node = node->next) {
+            ++count;
+        }
+        return count;
+    }
+
+    template <class F>
+    void Drain(TimerNode& head, F& fn) {
+        while (head.next != &head) {
+            TimerNode* node = head.next;
+            Cancel(node);
+            fn(node);
+        }
+    }
+};
+
+///////////////////////////////////////////////////////////////////////
+
+class ThreadPool;
+
+// A SubmitAfter or SubmitEvery timer. While it is on the wheel, self keeps
+// it alive.
+struct TimerState : TimerNode {
+    Task fn;
+    Task on_drop;  // run instead of fn if the pool shuts down first
+    uint64_t period = 0;  // in ticks, 0 for a one-shot timer
+    bool cancelled = false;
+    bool on_timer_thread = false;  // pool bookkeeping, run without a worker
+    std::shared_ptr<TimerState> self;
+};
+
+class TimerHandle {
+public:
+    TimerHandle()
+        : pool_(nullptr)
+    {}
+
+    TimerHandle(ThreadPool* pool, std::shared_ptr<TimerState> state)
+        : pool_(pool)
+        , state_(std::move(state))
+    {}
+
+    bool Valid() const {
+        return state_ != nullptr;
+    }
+
+    // Stops the timer. True if a run was still to come: a one-shot timer
+    // that had not fired yet, or a periodic one not cancelled before.
+    bool Cancel();
+
+private:
+    ThreadPool* pool_;
+    std::shared_ptr<TimerState> state_;
+};